@@ -154,6 +154,15 @@ static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
     desc->window_max_entries = max_entries;
 }
 
+/*
+ * The smallest size that tlb_mmu_resize_locked() will shrink a TLB to,
+ * raised from CPU_TLB_DYN_MIN_BITS by "-accel tcg,tlb-min-bits=N".
+ */
+static size_t tlb_min_size(void)
+{
+    return (size_t)1 << MAX(tcg_tlb_min_bits, CPU_TLB_DYN_MIN_BITS);
+}
+
 static void tb_jmp_cache_clear_page(CPUState *cpu, vaddr page_addr)
 {
     CPUJumpCache *jc = cpu->tb_jmp_cache;
@@ -213,6 +222,7 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
                                   int64_t now)
 {
     size_t old_size = tlb_n_entries(fast);
+    size_t min_size = tlb_min_size();
     size_t rate;
     size_t new_size = old_size;
     int64_t window_len_ms = 100;
@@ -243,7 +253,7 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
         if (expected_rate > 70) {
             ceil *= 2;
         }
-        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+        new_size = MAX(ceil, min_size);
     }
 
     if (new_size == old_size) {
@@ -291,7 +301,7 @@ static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
     desc->large_page_mask = -1;
     desc->vindex = 0;
     memset(fast->table, -1, sizeof_tlb(fast));
-    memset(desc->vtable, -1, sizeof(desc->vtable));
+    memset(desc->vtable, -1, desc->vtlb_size * sizeof(CPUTLBEntry));
 }
 
 static void tlb_flush_one_mmuidx_locked(CPUState *cpu, int mmu_idx,
@@ -306,13 +316,16 @@ static void tlb_flush_one_mmuidx_locked(CPUState *cpu, int mmu_idx,
 
 static void tlb_mmu_init(CPUTLBDesc *desc, CPUTLBDescFast *fast, int64_t now)
 {
-    size_t n_entries = 1 << CPU_TLB_DYN_DEFAULT_BITS;
+    size_t n_entries = MAX(1 << CPU_TLB_DYN_DEFAULT_BITS, tlb_min_size());
 
     tlb_window_reset(desc, now, 0);
     desc->n_used_entries = 0;
     fast->mask = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
     fast->table = g_new(CPUTLBEntry, n_entries);
     desc->fulltlb = g_new(CPUTLBEntryFull, n_entries);
+    desc->vtlb_size = tcg_vtlb_size;
+    desc->vtable = g_new(CPUTLBEntry, desc->vtlb_size);
+    desc->vfulltlb = g_new(CPUTLBEntryFull, desc->vtlb_size);
     tlb_mmu_flush_locked(desc, fast);
 }
 
@@ -352,6 +365,8 @@ void tlb_destroy(CPUState *cpu)
 
         g_free(fast->table);
         g_free(desc->fulltlb);
+        g_free(desc->vtable);
+        g_free(desc->vfulltlb);
     }
 }
 
@@ -494,7 +509,7 @@ static void tlb_flush_vtlb_page_mask_locked(CPUState *cpu, int mmu_idx,
     int k;
 
     assert_cpu_is_self(cpu);
-    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+    for (k = 0; k < d->vtlb_size; k++) {
         if (tlb_flush_entry_mask_locked(&d->vtable[k], page, mask)) {
             tlb_n_used_entries_dec(cpu, mmu_idx);
         }
@@ -945,7 +960,8 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                          start1, length);
         }
 
-        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        n = cpu->neg.tlb.d[mmu_idx].vtlb_size;
+        for (i = 0; i < n; i++) {
             tlb_reset_dirty_range_locked(&cpu->neg.tlb.d[mmu_idx].vtable[i],
                                          start1, length);
         }
@@ -978,7 +994,7 @@ static void tlb_set_dirty(CPUState *cpu, vaddr addr)
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        for (k = 0; k < cpu->neg.tlb.d[mmu_idx].vtlb_size; k++) {
             tlb_set_dirty1_locked(&cpu->neg.tlb.d[mmu_idx].vtable[k], addr);
         }
     }
@@ -1142,7 +1158,7 @@ void tlb_set_page_full(CPUState *cpu, int mmu_idx,
      * different page; otherwise just overwrite the stale data.
      */
     if (!tlb_hit_page_anyprot(te, addr_page) && !tlb_entry_is_empty(te)) {
-        unsigned vidx = desc->vindex++ % CPU_VTLB_SIZE;
+        unsigned vidx = desc->vindex++ % desc->vtlb_size;
         CPUTLBEntry *tv = &desc->vtable[vidx];
 
         /* Evict the old entry into the victim tlb.  */
@@ -1233,6 +1249,7 @@ static bool tlb_fill_align(CPUState *cpu, vaddr addr, MMUAccessType type,
     const TCGCPUOps *ops = cpu->cc->tcg_ops;
     CPUTLBEntryFull full;
 
+    qatomic_set(&cpu->neg.tlb.c.fill_count, cpu->neg.tlb.c.fill_count + 1);
     if (ops->tlb_fill_align) {
         if (ops->tlb_fill_align(cpu, &full, addr, type, mmu_idx,
                                 memop, size, probe, ra)) {
@@ -1297,10 +1314,12 @@ static void io_failed(CPUState *cpu, CPUTLBEntryFull *full, vaddr addr,
 static bool victim_tlb_hit(CPUState *cpu, size_t mmu_idx, size_t index,
                            MMUAccessType access_type, vaddr page)
 {
+    CPUTLBCommon *c = &cpu->neg.tlb.c;
     size_t vidx;
 
     assert_cpu_is_self(cpu);
-    for (vidx = 0; vidx < CPU_VTLB_SIZE; ++vidx) {
+    qatomic_set(&c->miss_count, c->miss_count + 1);
+    for (vidx = 0; vidx < cpu->neg.tlb.d[mmu_idx].vtlb_size; ++vidx) {
         CPUTLBEntry *vtlb = &cpu->neg.tlb.d[mmu_idx].vtable[vidx];
         uint64_t cmp = tlb_read_idx(vtlb, access_type);
 
@@ -1318,6 +1337,7 @@ static bool victim_tlb_hit(CPUState *cpu, size_t mmu_idx, size_t index,
             CPUTLBEntryFull *f2 = &cpu->neg.tlb.d[mmu_idx].vfulltlb[vidx];
             CPUTLBEntryFull tmpf;
             tmpf = *f1; *f1 = *f2; *f2 = tmpf;
+            qatomic_set(&c->victim_hit_count, c->victim_hit_count + 1);
             return true;
         }
     }
@@ -1979,7 +1999,8 @@ static uint64_t do_ld_mmio_beN(CPUState *cpu, CPUTLBEntryFull *full,
     section = io_prepare(&mr_offset, cpu, full->xlat_section, attrs, addr, ra);
     mr = section->mr;
 
-    BQL_LOCK_GUARD();
+    g_autoptr(BQLLockAuto) bql_guard __attribute__((unused)) =
+        mr->lockless_io ? NULL : bql_auto_lock(__FILE__, __LINE__);
     return int_ld_mmio_beN(cpu, full, ret_be, addr, size, mmu_idx,
                            type, ra, mr, mr_offset);
 }
@@ -2000,7 +2021,8 @@ static Int128 do_ld16_mmio_beN(CPUState *cpu, CPUTLBEntryFull *full,
     section = io_prepare(&mr_offset, cpu, full->xlat_section, attrs, addr, ra);
     mr = section->mr;
 
-    BQL_LOCK_GUARD();
+    g_autoptr(BQLLockAuto) bql_guard __attribute__((unused)) =
+        mr->lockless_io ? NULL : bql_auto_lock(__FILE__, __LINE__);
     a = int_ld_mmio_beN(cpu, full, ret_be, addr, size - 8, mmu_idx,
                         MMU_DATA_LOAD, ra, mr, mr_offset);
     b = int_ld_mmio_beN(cpu, full, ret_be, addr + size - 8, 8, mmu_idx,
@@ -2520,7 +2542,8 @@ static uint64_t do_st_mmio_leN(CPUState *cpu, CPUTLBEntryFull *full,
     section = io_prepare(&mr_offset, cpu, full->xlat_section, attrs, addr, ra);
     mr = section->mr;
 
-    BQL_LOCK_GUARD();
+    g_autoptr(BQLLockAuto) bql_guard __attribute__((unused)) =
+        mr->lockless_io ? NULL : bql_auto_lock(__FILE__, __LINE__);
     return int_st_mmio_leN(cpu, full, val_le, addr, size, mmu_idx,
                            ra, mr, mr_offset);
 }
@@ -2540,7 +2563,8 @@ static uint64_t do_st16_mmio_leN(CPUState *cpu, CPUTLBEntryFull *full,
     section = io_prepare(&mr_offset, cpu, full->xlat_section, attrs, addr, ra);
     mr = section->mr;
 
-    BQL_LOCK_GUARD();
+    g_autoptr(BQLLockAuto) bql_guard __attribute__((unused)) =
+        mr->lockless_io ? NULL : bql_auto_lock(__FILE__, __LINE__);
     int_st_mmio_leN(cpu, full, int128_getlo(val_le), addr, 8,
                     mmu_idx, ra, mr, mr_offset);
     return int_st_mmio_leN(cpu, full, int128_gethi(val_le), addr + 8,
@@ -16,6 +16,8 @@ extern int64_t max_delay;
 extern int64_t max_advance;
 
 extern bool one_insn_per_tb;
+extern unsigned int tcg_vtlb_size;
+extern unsigned int tcg_tlb_min_bits;
 
 /*
  * Return true if CS is not running in parallel with other cpus, either
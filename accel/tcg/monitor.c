@@ -235,10 +235,65 @@ HumanReadableText *qmp_x_query_opcount(Error **errp)
     return human_readable_text_from_str(buf);
 }
 
+/*
+ * Hits in the main TLB are resolved by generated code and are not
+ * counted; every miss goes through the victim TLB before the target
+ * is asked to fill the entry.
+ */
+static void dump_tlb_stats(CPUState *cpu, GString *buf)
+{
+    size_t miss = qatomic_read(&cpu->neg.tlb.c.miss_count);
+    size_t victim_hit = qatomic_read(&cpu->neg.tlb.c.victim_hit_count);
+    size_t fill = qatomic_read(&cpu->neg.tlb.c.fill_count);
+    int mmu_idx;
+
+    g_string_append_printf(buf, "CPU#%d:\n", cpu->cpu_index);
+    g_string_append_printf(buf, "  TLB misses          %zu\n", miss);
+    g_string_append_printf(buf, "  victim TLB hits     %zu (%zu%%)\n",
+                           victim_hit, miss ? victim_hit * 100 / miss : 0);
+    g_string_append_printf(buf, "  TLB fills           %zu\n", fill);
+    g_string_append_printf(buf, "  victim TLB size     %zu\n",
+                           cpu->neg.tlb.d[0].vtlb_size);
+    g_string_append_printf(buf, "  TLB full flushes    %zu\n",
+                           qatomic_read(&cpu->neg.tlb.c.full_flush_count));
+    g_string_append_printf(buf, "  TLB partial flushes %zu\n",
+                           qatomic_read(&cpu->neg.tlb.c.part_flush_count));
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        size_t used = qatomic_read(&cpu->neg.tlb.d[mmu_idx].n_used_entries);
+        uintptr_t mask = qatomic_read(&cpu->neg.tlb.f[mmu_idx].mask);
+
+        if (used) {
+            g_string_append_printf(buf, "  mmu_idx %-2d entries  %zu/%zu\n",
+                                   mmu_idx, used,
+                                   (size_t)(mask >> CPU_TLB_ENTRY_BITS) + 1);
+        }
+    }
+}
+
+HumanReadableText *qmp_x_query_tlb_stats(Error **errp)
+{
+    g_autoptr(GString) buf = g_string_new("");
+    CPUState *cpu;
+
+    if (!tcg_enabled()) {
+        error_setg(errp,
+                   "TLB statistics are only available with accel=tcg");
+        return NULL;
+    }
+
+    CPU_FOREACH(cpu) {
+        dump_tlb_stats(cpu, buf);
+    }
+
+    return human_readable_text_from_str(buf);
+}
+
 static void hmp_tcg_register(void)
 {
     monitor_register_hmp_info_hrt("jit", qmp_x_query_jit);
     monitor_register_hmp_info_hrt("opcount", qmp_x_query_opcount);
+    monitor_register_hmp_info_hrt("tlb-stats", qmp_x_query_tlb_stats);
 }
 
 type_init(hmp_tcg_register);
@@ -32,6 +32,7 @@
 #include "tb-context.h"
 #include "internal-common.h"
 #include "internal-target.h"
+#include "trace.h"
 
 
 /* List iterators for lists of tagged pointers in TranslationBlock. */
@@ -766,6 +767,8 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
         goto done;
     }
     did_flush = true;
+    trace_tb_flush(tb_flush_count.host_int, tcg_code_size(),
+                   tcg_code_capacity());
 
     CPU_FOREACH(cpu) {
         tcg_flush_jmp_cache(cpu);
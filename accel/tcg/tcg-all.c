@@ -35,8 +35,10 @@
 #include "qemu/atomic.h"
 #include "qapi/qapi-builtin-visit.h"
 #include "qemu/units.h"
+#include "hw/core/cpu.h"
 #if !defined(CONFIG_USER_ONLY)
 #include "hw/boards.h"
+#include "exec/cpu-defs.h"
 #endif
 #include "internal-common.h"
 
@@ -47,6 +49,8 @@ struct TCGState {
     bool one_insn_per_tb;
     int splitwx_enabled;
     unsigned long tb_size;
+    uint32_t vtlb_size;
+    uint32_t tlb_min_bits;
 };
 typedef struct TCGState TCGState;
 
@@ -95,10 +99,13 @@ static void tcg_accel_instance_init(Object *obj)
 #else
     s->splitwx_enabled = 0;
 #endif
+    s->vtlb_size = CPU_VTLB_DEFAULT_SIZE;
 }
 
 bool mttcg_enabled;
 bool one_insn_per_tb;
+unsigned int tcg_vtlb_size = CPU_VTLB_DEFAULT_SIZE;
+unsigned int tcg_tlb_min_bits;
 
 static int tcg_init_machine(MachineState *ms)
 {
@@ -111,6 +118,8 @@ static int tcg_init_machine(MachineState *ms)
 
     tcg_allowed = true;
     mttcg_enabled = s->mttcg_enabled;
+    tcg_vtlb_size = s->vtlb_size;
+    tcg_tlb_min_bits = s->tlb_min_bits;
 
     page_init();
     tb_htable_init();
@@ -181,6 +190,66 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+#if !defined(CONFIG_USER_ONLY)
+static void tcg_get_vtlb_size(Object *obj, Visitor *v,
+                              const char *name, void *opaque,
+                              Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->vtlb_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_vtlb_size(Object *obj, Visitor *v,
+                              const char *name, void *opaque,
+                              Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value < 1 || value > CPU_VTLB_MAX_SIZE) {
+        error_setg(errp, "vtlb-size must be between 1 and %d",
+                   CPU_VTLB_MAX_SIZE);
+        return;
+    }
+
+    s->vtlb_size = value;
+}
+
+static void tcg_get_tlb_min_bits(Object *obj, Visitor *v,
+                                 const char *name, void *opaque,
+                                 Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->tlb_min_bits;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_tlb_min_bits(Object *obj, Visitor *v,
+                                 const char *name, void *opaque,
+                                 Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > CPU_TLB_DYN_MAX_BITS) {
+        error_setg(errp, "tlb-min-bits must be at most %d",
+                   (int)CPU_TLB_DYN_MAX_BITS);
+        return;
+    }
+
+    s->tlb_min_bits = value;
+}
+#endif
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -242,6 +311,20 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "tb-size",
         "TCG translation block cache size");
 
+#if !defined(CONFIG_USER_ONLY)
+    object_class_property_add(oc, "vtlb-size", "int",
+        tcg_get_vtlb_size, tcg_set_vtlb_size,
+        NULL, NULL);
+    object_class_property_set_description(oc, "vtlb-size",
+        "Number of entries in the victim TLB of each MMU mode");
+
+    object_class_property_add(oc, "tlb-min-bits", "int",
+        tcg_get_tlb_min_bits, tcg_set_tlb_min_bits,
+        NULL, NULL);
+    object_class_property_set_description(oc, "tlb-min-bits",
+        "Log2 of the minimum number of entries in each TLB");
+#endif
+
     object_class_property_add_bool(oc, "split-wx",
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
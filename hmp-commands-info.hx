@@ -270,6 +270,20 @@ SRST
     Show dynamic compiler opcode counters
 ERST
 
+#if defined(CONFIG_TCG)
+    {
+        .name       = "tlb-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show softmmu TLB statistics of each vCPU",
+    },
+#endif
+
+SRST
+  ``info tlb-stats``
+    Show softmmu TLB statistics of each vCPU.
+ERST
+
     {
         .name       = "sync-profile",
         .args_type  = "mean:-m,no_coalesce:-n,max:i?",
@@ -886,7 +900,7 @@ ERST
         .name       = "stats",
         .args_type  = "target:s,names:s?,provider:s?",
         .params     = "target [names] [provider]",
-        .help       = "show statistics for the given target (vm or vcpu); optionally filter by"
+        .help       = "show statistics for the given target (vm, vcpu, cryptodev or taic); optionally filter by"
                       "name (comma-separated list, or * for all) and provider",
         .cmd        = hmp_info_stats,
     },
@@ -57,6 +57,7 @@
 #include "qapi/qapi-visit-common.h"
 #include "hw/virtio/virtio-iommu.h"
 #include "hw/taic.h"
+#include "hw/core/split-irq.h"
 
 /* KVM AIA only supports APLIC MSI. APLIC Wired is always emulated by QEMU. */
 static bool virt_use_kvm_aia(RISCVVirtState *s)
@@ -74,6 +75,7 @@ static const MemMapEntry virt_memmap[] = {
     [VIRT_MROM] =         {     0x1000,        0xf000 },
     [VIRT_TEST] =         {   0x100000,        0x1000 },
     [VIRT_RTC] =          {   0x101000,        0x1000 },
+    [VIRT_TAIC_MSI] =     {   0x800000,      0x100000 },
     [VIRT_TAIC] =         {  0x1000000,     0x1000000 },
     [VIRT_CLINT] =        {  0x2000000,       0x10000 },
     [VIRT_ACLINT_SSWI] =  {  0x2F00000,        0x4000 },
@@ -85,6 +87,7 @@ static const MemMapEntry virt_memmap[] = {
     [VIRT_UART0] =        { 0x10000000,         0x100 },
     [VIRT_VIRTIO] =       { 0x10001000,        0x1000 },
     [VIRT_FW_CFG] =       { 0x10100000,          0x18 },
+    [VIRT_TAIC_REMOTE] =  { 0x11000000,     0x1000000 },
     [VIRT_FLASH] =        { 0x20000000,     0x4000000 },
     [VIRT_IMSIC_M] =      { 0x24000000, VIRT_IMSIC_MAX_SIZE },
     [VIRT_IMSIC_S] =      { 0x28000000, VIRT_IMSIC_MAX_SIZE },
@@ -668,13 +671,28 @@ static void create_fdt_one_aplic(RISCVVirtState *s, int socket,
     qemu_fdt_setprop_cell(ms->fdt, aplic_name, "phandle", aplic_phandle);
 }
 
+/*
+ * The TAIC of socket 0 stays at VIRT_TAIC, the window behind it is taken by
+ * the CLINT so the TAICs of the other sockets live at VIRT_TAIC_REMOTE.
+ */
+static hwaddr virt_taic_addr(const MemMapEntry *memmap, int socket)
+{
+    if (socket == 0) {
+        return memmap[VIRT_TAIC].base;
+    }
+    return memmap[VIRT_TAIC_REMOTE].base +
+           (socket - 1) * memmap[VIRT_TAIC_REMOTE].size;
+}
+
 static void create_fdt_socket_taic(RISCVVirtState *s, const MemMapEntry *memmap, int socket, uint32_t *phandle) {
     char *taic_name;
-    unsigned long taic_addr;
+    unsigned long taic_addr, msi_addr;
     MachineState *taic = MACHINE(s);
     static const char *const taic_compat[1] = {"taic-0.0.0"};
+    static const char *const taic_reg_names[2] = {"queues", "msi"};
 
-    taic_addr = memmap[VIRT_TAIC].base + (memmap[VIRT_TAIC].size * socket);
+    taic_addr = virt_taic_addr(memmap, socket);
+    msi_addr = memmap[VIRT_TAIC_MSI].base + (memmap[VIRT_TAIC_MSI].size * socket);
     taic_name = g_strdup_printf("/soc/taic@%lx", taic_addr);
     qemu_fdt_add_subnode(taic->fdt, taic_name);
     qemu_fdt_setprop_cell(taic->fdt, taic_name,
@@ -687,7 +705,14 @@ static void create_fdt_socket_taic(RISCVVirtState *s, const MemMapEntry *memmap,
                                   (char **)&taic_compat,
                                   ARRAY_SIZE(taic_compat));
     qemu_fdt_setprop(taic->fdt, taic_name, "interrupt-controller", NULL, 0);
-    qemu_fdt_setprop_cells(taic->fdt, taic_name, "reg", 0x0, taic_addr, 0x0, memmap[VIRT_TAIC].size);
+    qemu_fdt_setprop_cells(taic->fdt, taic_name, "reg", 0x0, taic_addr, 0x0, memmap[VIRT_TAIC].size,
+                           0x0, msi_addr, 0x0, (uint64_t)s->taic_gq_num * PAGE_SIZE);
+    qemu_fdt_setprop_string_array(taic->fdt, taic_name, "reg-names",
+                                  (char **)&taic_reg_names,
+                                  ARRAY_SIZE(taic_reg_names));
+    qemu_fdt_setprop_cell(taic->fdt, taic_name, "taic,num-gqs", s->taic_gq_num);
+    qemu_fdt_setprop_cell(taic->fdt, taic_name, "taic,num-lqs", s->taic_lq_num);
+    qemu_fdt_setprop_cell(taic->fdt, taic_name, "taic,num-irqs", s->taic_intr_num);
     riscv_socket_fdt_write_id(taic, taic_name, socket);
     g_free(taic_name);
 
@@ -1147,8 +1172,29 @@ static void create_fdt(RISCVVirtState *s, const MemMapEntry *memmap)
     create_fdt_pmu(s);
 }
 
+/*
+ * Return the input line of interrupt source @irq of @socket. With taic-irq
+ * the source is split so that it drives both the PLIC/AIA and the TAIC of
+ * the socket, and TAIC handlers use the same source numbers as the PLIC.
+ */
+static qemu_irq virt_irq_line(RISCVVirtState *s, int socket, int irq)
+{
+    qemu_irq line = qdev_get_gpio_in(s->irqchip[socket], irq);
+    DeviceState *split;
+
+    if (!s->taic_irq) {
+        return line;
+    }
+    split = qdev_new(TYPE_SPLIT_IRQ);
+    qdev_prop_set_uint32(split, "num-lines", 2);
+    qdev_realize_and_unref(split, NULL, &error_fatal);
+    qdev_connect_gpio_out(split, 0, line);
+    qdev_connect_gpio_out(split, 1, qdev_get_gpio_in(s->taic[socket], irq));
+    return qdev_get_gpio_in(split, 0);
+}
+
 static inline DeviceState *gpex_pcie_init(MemoryRegion *sys_mem,
-                                          DeviceState *irqchip,
+                                          int socket,
                                           RISCVVirtState *s)
 {
     DeviceState *dev;
@@ -1211,7 +1257,7 @@ static inline DeviceState *gpex_pcie_init(MemoryRegion *sys_mem,
     sysbus_mmio_map(SYS_BUS_DEVICE(dev), 2, pio_base);
 
     for (i = 0; i < GPEX_NUM_IRQS; i++) {
-        irq = qdev_get_gpio_in(irqchip, PCIE_IRQ + i);
+        irq = virt_irq_line(s, socket, PCIE_IRQ + i);
 
         sysbus_connect_irq(SYS_BUS_DEVICE(dev), i, irq);
         gpex_set_irq_num(GPEX_HOST(dev), i, PCIE_IRQ + i);
@@ -1233,9 +1279,15 @@ static FWCfgState *create_fw_cfg(const MachineState *ms)
     return fw_cfg;
 }
 
-static DeviceState *virt_create_taic(const MemMapEntry *memmap, int socket, int hart_count)
+static DeviceState *virt_create_taic(RISCVVirtState *s, const MemMapEntry *memmap,
+                                     int socket, int base_hartid, int hart_count)
 {
-    DeviceState *ret = taic_create(memmap[VIRT_TAIC].base + socket * memmap[VIRT_TAIC].size, hart_count, VIRT_IRQCHIP_NUM_SOURCES);
+    DeviceState *ret = taic_create(virt_taic_addr(memmap, socket),
+                                   memmap[VIRT_TAIC_MSI].base +
+                                   socket * memmap[VIRT_TAIC_MSI].size,
+                                   base_hartid, hart_count, VIRT_IRQCHIP_NUM_SOURCES,
+                                   s->taic_gq_num, s->taic_lq_num,
+                                   s->taic_intr_num);
     return ret;
 }
 
@@ -1323,7 +1375,7 @@ static DeviceState *virt_create_aia(RISCVVirtAIAType aia_type, int aia_guests,
     return kvm_enabled() ? aplic_s : aplic_m;
 }
 
-static void create_platform_bus(RISCVVirtState *s, DeviceState *irqchip)
+static void create_platform_bus(RISCVVirtState *s, int socket)
 {
     DeviceState *dev;
     SysBusDevice *sysbus;
@@ -1341,7 +1393,7 @@ static void create_platform_bus(RISCVVirtState *s, DeviceState *irqchip)
     sysbus = SYS_BUS_DEVICE(dev);
     for (i = 0; i < VIRT_PLATFORM_BUS_NUM_IRQS; i++) {
         int irq = VIRT_PLATFORM_BUS_IRQ + i;
-        sysbus_connect_irq(sysbus, i, qdev_get_gpio_in(irqchip, irq));
+        sysbus_connect_irq(sysbus, i, virt_irq_line(s, socket, irq));
     }
 
     memory_region_add_subregion(sysmem,
@@ -1489,8 +1541,8 @@ static void virt_machine_init(MachineState *machine)
     RISCVVirtState *s = RISCV_VIRT_MACHINE(machine);
     MemoryRegion *system_memory = get_system_memory();
     MemoryRegion *mask_rom = g_new(MemoryRegion, 1);
-    DeviceState *mmio_irqchip, *virtio_irqchip, *pcie_irqchip, *taic_irqchip;
-    int i, base_hartid, hart_count;
+    int mmio_socket, virtio_socket, pcie_socket;
+    int i, j, base_hartid, hart_count;
     int socket_count = riscv_socket_count(machine);
 
     /* Check socket count limit */
@@ -1505,8 +1557,25 @@ static void virt_machine_init(MachineState *machine)
         exit(1);
     }
 
+    if ((uint64_t)s->taic_gq_num * PAGE_SIZE > memmap[VIRT_TAIC_MSI].size) {
+        error_report("the TAIC MSI window only fits %" PRIu64 " global queues",
+                     memmap[VIRT_TAIC_MSI].size / PAGE_SIZE);
+        exit(1);
+    }
+
+    /* Every routed source needs a TAIC handler slot */
+    if (s->taic_irq) {
+        if (!s->taic_intr_num_set) {
+            s->taic_intr_num = VIRT_IRQCHIP_NUM_SOURCES;
+        } else if (s->taic_intr_num < VIRT_IRQCHIP_NUM_SOURCES) {
+            error_report("'taic-irq' needs 'taic-intr-num' of at least %d",
+                         VIRT_IRQCHIP_NUM_SOURCES);
+            exit(1);
+        }
+    }
+
     /* Initialize sockets */
-    mmio_irqchip = virtio_irqchip = pcie_irqchip = taic_irqchip = NULL;
+    mmio_socket = virtio_socket = pcie_socket = 0;
     for (i = 0; i < socket_count; i++) {
         g_autofree char *soc_name = g_strdup_printf("soc%d", i);
 
@@ -1576,7 +1645,7 @@ static void virt_machine_init(MachineState *machine)
                     RISCV_ACLINT_DEFAULT_TIMEBASE_FREQ, true);
         }
 
-        s->taic[i] = virt_create_taic(memmap, i, hart_count);
+        s->taic[i] = virt_create_taic(s, memmap, i, base_hartid, hart_count);
         /* Per-socket interrupt controller */
         if (s->aia_type == VIRT_AIA_TYPE_NONE) {
             s->irqchip[i] = virt_create_plic(memmap, i,
@@ -1589,18 +1658,33 @@ static void virt_machine_init(MachineState *machine)
 
         /* Try to use different IRQCHIP instance based device type */
         if (i == 0) {
-            taic_irqchip = s->taic[i];
-            mmio_irqchip = s->irqchip[i];
-            virtio_irqchip = s->irqchip[i];
-            pcie_irqchip = s->irqchip[i];
+            mmio_socket = i;
+            virtio_socket = i;
+            pcie_socket = i;
         }
         if (i == 1) {
-            taic_irqchip = s->taic[i];
-            virtio_irqchip = s->irqchip[i];
-            pcie_irqchip = s->irqchip[i];
+            virtio_socket = i;
+            pcie_socket = i;
         }
         if (i == 2) {
-            pcie_irqchip = s->irqchip[i];
+            pcie_socket = i;
+        }
+    }
+
+    /* Route soft interrupts and remote load balancing between the sockets */
+    if (socket_count > 1) {
+        TaicFabric *fabric = taic_fabric_new(socket_count);
+
+        for (i = 0; i < socket_count; i++) {
+            taic_fabric_add(fabric, i, TAIC(s->taic[i]));
+        }
+        if (machine->numa_state && machine->numa_state->have_numa_distance) {
+            for (i = 0; i < socket_count; i++) {
+                for (j = 0; j < socket_count; j++) {
+                    taic_fabric_set_distance(fabric, i, j,
+                        machine->numa_state->nodes[i].distance[j]);
+                }
+            }
         }
     }
 
@@ -1655,26 +1739,19 @@ static void virt_machine_init(MachineState *machine)
     for (i = 0; i < VIRTIO_COUNT; i++) {
         sysbus_create_simple("virtio-mmio",
             memmap[VIRT_VIRTIO].base + i * memmap[VIRT_VIRTIO].size,
-            qdev_get_gpio_in(virtio_irqchip, VIRTIO_IRQ + i));
+            virt_irq_line(s, virtio_socket, VIRTIO_IRQ + i));
     }
 
-    // only connect to virtio irq
-    for (i = 0; i < VIRTIO_COUNT; i++) {
-        sysbus_create_simple("virtio-mmio",
-            memmap[VIRT_VIRTIO].base + i * memmap[VIRT_VIRTIO].size,
-            qdev_get_gpio_in(taic_irqchip, VIRTIO_IRQ + i));
-    }
+    gpex_pcie_init(system_memory, pcie_socket, s);
 
-    gpex_pcie_init(system_memory, pcie_irqchip, s);
-
-    create_platform_bus(s, mmio_irqchip);
+    create_platform_bus(s, mmio_socket);
 
     serial_mm_init(system_memory, memmap[VIRT_UART0].base,
-        0, qdev_get_gpio_in(mmio_irqchip, UART0_IRQ), 399193,
+        0, virt_irq_line(s, mmio_socket, UART0_IRQ), 399193,
         serial_hd(0), DEVICE_LITTLE_ENDIAN);
 
     sysbus_create_simple("goldfish_rtc", memmap[VIRT_RTC].base,
-        qdev_get_gpio_in(mmio_irqchip, RTC_IRQ));
+        virt_irq_line(s, mmio_socket, RTC_IRQ));
 
     for (i = 0; i < ARRAY_SIZE(s->flash); i++) {
         /* Map legacy -drive if=pflash to machine properties */
@@ -1707,6 +1784,10 @@ static void virt_machine_instance_init(Object *obj)
     s->oem_id = g_strndup(ACPI_BUILD_APPNAME6, 6);
     s->oem_table_id = g_strndup(ACPI_BUILD_APPNAME8, 8);
     s->acpi = ON_OFF_AUTO_AUTO;
+    s->taic_gq_num = GQ_NUM;
+    s->taic_lq_num = LQ_NUM;
+    s->taic_intr_num = INTR_NUM;
+    s->taic_irq = false;
 }
 
 static char *virt_get_aia_guests(Object *obj, Error **errp)
@@ -1765,6 +1846,20 @@ static void virt_set_aia(Object *obj, const char *val, Error **errp)
     }
 }
 
+static bool virt_get_taic_irq(Object *obj, Error **errp)
+{
+    RISCVVirtState *s = RISCV_VIRT_MACHINE(obj);
+
+    return s->taic_irq;
+}
+
+static void virt_set_taic_irq(Object *obj, bool value, Error **errp)
+{
+    RISCVVirtState *s = RISCV_VIRT_MACHINE(obj);
+
+    s->taic_irq = value;
+}
+
 static bool virt_get_aclint(Object *obj, Error **errp)
 {
     RISCVVirtState *s = RISCV_VIRT_MACHINE(obj);
@@ -1801,6 +1896,45 @@ static void virt_set_acpi(Object *obj, Visitor *v, const char *name,
     visit_type_OnOffAuto(v, name, &s->acpi, errp);
 }
 
+static void virt_get_taic_geometry(Object *obj, Visitor *v, const char *name,
+                                   void *opaque, Error **errp)
+{
+    RISCVVirtState *s = RISCV_VIRT_MACHINE(obj);
+    uint32_t *field = (uint32_t *)((char *)s + (uintptr_t)opaque);
+
+    visit_type_uint32(v, name, field, errp);
+}
+
+static void virt_set_taic_geometry(Object *obj, Visitor *v, const char *name,
+                                   void *opaque, Error **errp)
+{
+    RISCVVirtState *s = RISCV_VIRT_MACHINE(obj);
+    uint32_t *field = (uint32_t *)((char *)s + (uintptr_t)opaque);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value == 0) {
+        error_setg(errp, "'%s' must be non-zero", name);
+        return;
+    }
+    *field = value;
+}
+
+static void virt_set_taic_intr_num(Object *obj, Visitor *v, const char *name,
+                                   void *opaque, Error **errp)
+{
+    ERRP_GUARD();
+    RISCVVirtState *s = RISCV_VIRT_MACHINE(obj);
+
+    virt_set_taic_geometry(obj, v, name, opaque, errp);
+    if (*errp) {
+        return;
+    }
+    s->taic_intr_num_set = true;
+}
+
 static HotplugHandler *virt_machine_get_hotplug_handler(MachineState *machine,
                                                         DeviceState *dev)
 {
@@ -1898,6 +2032,36 @@ static void virt_machine_class_init(ObjectClass *oc, void *data)
                               NULL, NULL);
     object_class_property_set_description(oc, "acpi",
                                           "Enable ACPI");
+
+    object_class_property_add(oc, "taic-gq-num", "uint32",
+                              virt_get_taic_geometry, virt_set_taic_geometry,
+                              NULL,
+                              (void *)offsetof(RISCVVirtState, taic_gq_num));
+    object_class_property_set_description(oc, "taic-gq-num",
+                                          "Number of TAIC global queues "
+                                          "(processes) per socket");
+    object_class_property_add(oc, "taic-lq-num", "uint32",
+                              virt_get_taic_geometry, virt_set_taic_geometry,
+                              NULL,
+                              (void *)offsetof(RISCVVirtState, taic_lq_num));
+    object_class_property_set_description(oc, "taic-lq-num",
+                                          "Number of TAIC local queues "
+                                          "per global queue");
+    object_class_property_add(oc, "taic-intr-num", "uint32",
+                              virt_get_taic_geometry, virt_set_taic_intr_num,
+                              NULL,
+                              (void *)offsetof(RISCVVirtState, taic_intr_num));
+    object_class_property_set_description(oc, "taic-intr-num",
+                                          "Number of TAIC interrupt handler "
+                                          "slots per global queue");
+    object_class_property_add_bool(oc, "taic-irq", virt_get_taic_irq,
+                                   virt_set_taic_irq);
+    object_class_property_set_description(oc, "taic-irq",
+                                          "Set on/off to deliver the UART, "
+                                          "RTC, virtio-mmio, PCIe INTx and "
+                                          "platform bus interrupts to TAIC "
+                                          "as well as to the PLIC/AIA "
+                                          "(default: off)");
 }
 
 static const TypeInfo virt_machine_typeinfo = {
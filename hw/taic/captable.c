@@ -0,0 +1,102 @@
+#include "hw/taic.h"
+#include "qemu/xxhash.h"
+
+/*
+ * 以 (os_id, proc_id) 为键的开放寻址哈希表，使用线性探测。
+ * 表的大小至少是容量的两倍，查找、插入和删除的期望代价都是 O(1)。
+ * 删除时把后续的表项向前移动，因此不需要墓碑标记。
+ */
+static inline bool captable_empty(CapEntry* entry) {
+    return entry->os_id == 0 && entry->proc_id == 0;
+}
+
+static inline uint64_t captable_home(CapTable* table, uint64_t os_id, uint64_t proc_id) {
+    return qemu_xxhash4(os_id, proc_id) & table->mask;
+}
+
+void captable_init(CapTable* table, uint64_t cap) {
+    uint64_t size = pow2ceil(MAX(cap, 1) * 2);
+    table->cap = cap;
+    table->count = 0;
+    table->mask = size - 1;
+    table->entries = g_new0(CapEntry, size);
+}
+
+CapEntry* captable_lookup(CapTable* table, uint64_t os_id, uint64_t proc_id) {
+    if(os_id == 0 && proc_id == 0) {
+        return NULL;
+    }
+    uint64_t idx = captable_home(table, os_id, proc_id);
+    // 限制探测次数，并发读者在表被修改时也不会死循环
+    for(uint64_t n = 0; n <= table->mask; n++) {
+        CapEntry* entry = &table->entries[idx];
+        uint64_t entry_os = qatomic_read(&entry->os_id);
+        uint64_t entry_proc = qatomic_read(&entry->proc_id);
+        if(entry_os == os_id && entry_proc == proc_id) {
+            return entry;
+        } else if(entry_os == 0 && entry_proc == 0) {
+            return NULL;
+        }
+        idx = (idx + 1) & table->mask;
+    }
+    return NULL;
+}
+
+CapEntry* captable_insert(CapTable* table, uint64_t os_id, uint64_t proc_id) {
+    if(os_id == 0 && proc_id == 0) {
+        return NULL;
+    }
+    uint64_t idx = captable_home(table, os_id, proc_id);
+    while(1) {
+        CapEntry* entry = &table->entries[idx];
+        if(entry->os_id == os_id && entry->proc_id == proc_id) {
+            return entry;
+        } else if(captable_empty(entry)) {
+            if(table->count >= table->cap) {
+                return NULL;
+            }
+            table->count++;
+            entry->value = 0;
+            qatomic_set(&entry->proc_id, proc_id);
+            qatomic_set(&entry->os_id, os_id);
+            return entry;
+        }
+        idx = (idx + 1) & table->mask;
+    }
+}
+
+bool captable_remove(CapTable* table, uint64_t os_id, uint64_t proc_id) {
+    CapEntry* entry = captable_lookup(table, os_id, proc_id);
+    if(entry == NULL) {
+        return false;
+    }
+    uint64_t hole = entry - table->entries;
+    uint64_t idx = hole;
+    while(1) {
+        idx = (idx + 1) & table->mask;
+        CapEntry* next = &table->entries[idx];
+        if(captable_empty(next)) {
+            break;
+        }
+        // 如果 next 的初始位置不在 (hole, idx] 之间，就把它移到空洞处
+        uint64_t home = captable_home(table, next->os_id, next->proc_id);
+        bool in_range = hole <= idx ? (hole < home && home <= idx)
+                                    : (hole < home || home <= idx);
+        if(!in_range) {
+            table->entries[hole].value = next->value;
+            qatomic_set(&table->entries[hole].proc_id, next->proc_id);
+            qatomic_set(&table->entries[hole].os_id, next->os_id);
+            hole = idx;
+        }
+    }
+    qatomic_set(&table->entries[hole].os_id, 0);
+    qatomic_set(&table->entries[hole].proc_id, 0);
+    table->entries[hole].value = 0;
+    table->count--;
+    return true;
+}
+
+void captable_clear(CapTable* table) {
+    memset(table->entries, 0, sizeof(CapEntry) * (table->mask + 1));
+    table->count = 0;
+}
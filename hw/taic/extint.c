@@ -1,64 +1,68 @@
 #include "hw/taic.h"
 
-enum ExtIntrState {
-    EINT_IDLE = 0,
-    REG_EXT = 1,
-    WAKEUP_EXT = 2,
-    CLEAN_EXT = 3,
-};
-
+/*
+ * lock 保护每个槽位的处理任务和待处理事件数。没有注册处理任务时到达的事件
+ * 记录在 pending 中，注册处理任务时一并返回，由调用者唤醒。
+ * registered 记录全局队列是否注册了该中断源：一次性的处理任务被唤醒后仍然是注册的，
+ * 之后的事件继续计入 pending，写入处理任务 0 才取消注册。
+ */
 void init_extintrslots(ExtIntrSlots* extintrslots, uint64_t size) {
+    qemu_spin_init(&extintrslots->lock);
     extintrslots->cap = size;
-    extintrslots->state = 0;
     extintrslots->slots = g_new0(uint64_t, size);
+    extintrslots->pending = g_new0(uint32_t, size);
+    extintrslots->registered = g_new0(bool, size);
 }
 
-void register_ext(ExtIntrSlots* extintrslots, uint64_t irq, uint64_t handler) {
+// 返回注册时立即唤醒处理任务的次数，一次性的处理任务最多消耗一个待处理事件
+uint64_t register_ext(ExtIntrSlots* extintrslots, uint64_t irq, uint64_t handler) {
+    uint64_t count = 0;
     if(irq >= extintrslots->cap) {
         error_report("The irq is out of range");
-        return;
+        return 0;
     }
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&extintrslots->state, EINT_IDLE, REG_EXT);
-        if(state == EINT_IDLE) {
-            extintrslots->slots[irq] = handler;
-            qatomic_set(&extintrslots->state, EINT_IDLE);
-            return;
+    qemu_spin_lock(&extintrslots->lock);
+    qatomic_set(&extintrslots->registered[irq], handler != 0);
+    if(handler != 0 && extintrslots->pending[irq] != 0) {
+        if(handler & TAIC_HANDLER_PERSISTENT) {
+            count = extintrslots->pending[irq];
+            extintrslots->pending[irq] = 0;
+        } else {
+            count = 1;
+            extintrslots->pending[irq]--;
+            handler = 0;
         }
     }
+    qatomic_set(&extintrslots->slots[irq], handler);
+    qemu_spin_unlock(&extintrslots->lock);
+    return count;
 }
 
+// 持久的处理任务在唤醒后仍然保持注册
 uint64_t wakeup_ext(ExtIntrSlots* extintrslots, uint64_t irq) {
     if(irq >= extintrslots->cap) {
         error_report("The irq is out of range");
         return 0;
     }
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&extintrslots->state, EINT_IDLE, WAKEUP_EXT);
-        if(state == EINT_IDLE) {
-            int64_t res = extintrslots->slots[irq];
-            extintrslots->slots[irq] = 0;
-            qatomic_set(&extintrslots->state, EINT_IDLE);
-            return res;
+    qemu_spin_lock(&extintrslots->lock);
+    uint64_t handler = extintrslots->slots[irq];
+    if(handler == 0) {
+        if(extintrslots->pending[irq] != UINT32_MAX) {
+            extintrslots->pending[irq]++;
         }
+    } else if(!(handler & TAIC_HANDLER_PERSISTENT)) {
+        qatomic_set(&extintrslots->slots[irq], 0);
     }
+    qemu_spin_unlock(&extintrslots->lock);
+    return handler;
 }
 
 void clean_extintrslots(ExtIntrSlots* extintrslots) {
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&extintrslots->state, EINT_IDLE, CLEAN_EXT);
-        if(state == EINT_IDLE) {
-            for (uint64_t i = 0; i < extintrslots->cap; i++) {
-                extintrslots->slots[i] = 0;
-            }
-            qatomic_set(&extintrslots->state, EINT_IDLE);
-            return;
-        }
+    qemu_spin_lock(&extintrslots->lock);
+    for (uint64_t i = 0; i < extintrslots->cap; i++) {
+        qatomic_set(&extintrslots->slots[i], 0);
+        extintrslots->pending[i] = 0;
+        qatomic_set(&extintrslots->registered[i], false);
     }
-}
\ No newline at end of file
+    qemu_spin_unlock(&extintrslots->lock);
+}
@@ -0,0 +1,147 @@
+#include "hw/taic.h"
+#include "trace.h"
+
+/*
+ * 多个 socket 的 TAIC 组成的互连结构，每个 socket 一个 TAIC。
+ * 本地的 TAIC 找不到软件中断的接收方时，按照距离从近到远查找其他 socket 的 TAIC；
+ * 允许跨 socket 负载均衡的全局队列也按照同样的顺序从其他 socket 迁移任务。
+ * 距离的含义与 ACPI SLIT 相同，自身的距离为 10，默认其他 socket 的距离为 20。
+ * 互连结构只描述拓扑，由机器在创建时建立，不参与复位和迁移。
+ */
+#define TAIC_FABRIC_LOCAL_DISTANCE   10
+#define TAIC_FABRIC_REMOTE_DISTANCE  20
+
+struct TaicFabric {
+    uint32_t num;
+    TAICState** members;
+    uint8_t* distance;      // num * num
+    uint32_t* order;        // 每个节点的其他节点，按距离从近到远排列，num * (num - 1)
+};
+
+static inline uint8_t fabric_distance(TaicFabric* fabric, uint32_t a, uint32_t b) {
+    return fabric->distance[a * fabric->num + b];
+}
+
+static inline uint32_t* fabric_peers(TaicFabric* fabric, uint32_t node) {
+    return &(fabric->order[node * (fabric->num - 1)]);
+}
+
+// 距离相同时编号小的节点在前，保证每次查找的顺序是确定的
+static void fabric_sort_peers(TaicFabric* fabric, uint32_t node) {
+    uint32_t* peers = fabric_peers(fabric, node);
+    uint32_t n = 0;
+    for(uint32_t i = 0; i < fabric->num; i++) {
+        if(i == node) {
+            continue;
+        }
+        uint32_t j = n++;
+        while(j > 0 && fabric_distance(fabric, node, peers[j - 1]) > fabric_distance(fabric, node, i)) {
+            peers[j] = peers[j - 1];
+            j--;
+        }
+        peers[j] = i;
+    }
+}
+
+TaicFabric* taic_fabric_new(uint32_t num) {
+    TaicFabric* fabric = g_new0(TaicFabric, 1);
+    fabric->num = num;
+    fabric->members = g_new0(TAICState*, num);
+    fabric->distance = g_new0(uint8_t, num * num);
+    fabric->order = g_new0(uint32_t, num * (num - 1));
+    for(uint32_t i = 0; i < num; i++) {
+        for(uint32_t j = 0; j < num; j++) {
+            fabric->distance[i * num + j] = i == j ? TAIC_FABRIC_LOCAL_DISTANCE : TAIC_FABRIC_REMOTE_DISTANCE;
+        }
+    }
+    for(uint32_t i = 0; i < num; i++) {
+        fabric_sort_peers(fabric, i);
+    }
+    return fabric;
+}
+
+void taic_fabric_add(TaicFabric* fabric, uint32_t node, TAICState* taic) {
+    assert(node < fabric->num && fabric->members[node] == NULL);
+    fabric->members[node] = taic;
+    taic->fabric = fabric;
+    taic->node = node;
+}
+
+void taic_fabric_set_distance(TaicFabric* fabric, uint32_t a, uint32_t b, uint8_t distance) {
+    assert(a < fabric->num && b < fabric->num);
+    if(a == b || distance == 0) {
+        return;
+    }
+    fabric->distance[a * fabric->num + b] = distance;
+    fabric_sort_peers(fabric, a);
+}
+
+// 把软件中断发送到最近的注册了接收方 (recv_os, recv_proc) 的其他 socket
+bool taic_fabric_send_softintr(TAICState* taic, uint64_t send_os, uint64_t send_proc, uint64_t recv_os,
+                               uint64_t recv_proc) {
+    TaicFabric* fabric = taic->fabric;
+    if(fabric == NULL) {
+        return false;
+    }
+    uint32_t* peers = fabric_peers(fabric, taic->node);
+    for(uint32_t i = 0; i + 1 < fabric->num; i++) {
+        TAICState* peer = fabric->members[peers[i]];
+        if(peer == NULL) {
+            continue;
+        }
+        int64_t idx = taic_find_gq(peer, recv_os, recv_proc);
+        if(idx == -1) {
+            continue;
+        }
+        trace_taic_fabric_softintr(taic->node, peers[i], idx);
+        if(handle_softintr(&(peer->gqs[idx]), send_os, send_proc)) {
+            taic_raise_softirq(peer, idx);
+        }
+        return true;
+    }
+    return false;
+}
+
+// 本地没有可以迁移的任务时，从其他 socket 中同一个 OS 的全局队列迁移任务，
+// 双方都需要设置 TAIC_BALANCE_REMOTE，并且距离不超过迁入方设置的最大距离
+uint64_t taic_fabric_migrate(TAICState* taic, uint64_t gq_idx, uint64_t* data, uint64_t n) {
+    TaicFabric* fabric = taic->fabric;
+    GlobalQueue* gq = &(taic->gqs[gq_idx]);
+    uint64_t cap = qatomic_read(&gq->balance_cap);
+    if(fabric == NULL || !(cap & TAIC_BALANCE_IMPORT) || !(cap & TAIC_BALANCE_REMOTE)) {
+        return 0;
+    }
+    uint64_t max_distance = TAIC_BALANCE_MAX_DISTANCE(cap);
+    uint64_t os_id = qatomic_read(&gq->os_id);
+    uint32_t* peers = fabric_peers(fabric, taic->node);
+    for(uint32_t i = 0; i + 1 < fabric->num; i++) {
+        TAICState* peer = fabric->members[peers[i]];
+        if(max_distance != 0 && fabric_distance(fabric, taic->node, peers[i]) > max_distance) {
+            break;      // 其余节点更远
+        }
+        if(peer == NULL) {
+            continue;
+        }
+        for(uint64_t j = 0; j < peer->gq_num; j++) {
+            GlobalQueue* victim = &(peer->gqs[j]);
+            // 不同 socket 上同一个进程的全局队列也可以迁移
+            if(qatomic_read(&victim->os_id) != os_id) {
+                continue;
+            }
+            if(os_id == 0 && qatomic_read(&victim->proc_id) == 0) {     // 空闲的全局队列
+                continue;
+            }
+            uint64_t victim_cap = qatomic_read(&victim->balance_cap);
+            if(!(victim_cap & TAIC_BALANCE_EXPORT) || !(victim_cap & TAIC_BALANCE_REMOTE)) {
+                continue;
+            }
+            uint64_t res = gq_steal(victim, data, n);
+            if(res != 0) {
+                trace_taic_fabric_migrate(taic->node, peers[i], res);
+                qatomic_add(&gq->migrations, res);
+                return res;
+            }
+        }
+    }
+    return 0;
+}
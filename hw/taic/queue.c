@@ -1,38 +1,106 @@
 #include "hw/taic.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
-void init_local_queue(LocalQueue* local_queue) {
+void init_local_queue(LocalQueue* local_queue, uint32_t capacity, uint32_t prio_num, uint64_t* latency_hist) {
+    qemu_spin_init(&local_queue->lock);
     local_queue->is_used = false;
-    local_queue->ready_queue = g_new0(Queue, 1);
-    queue_init(local_queue->ready_queue);
+    local_queue->ready_queue = g_new0(Queue, prio_num);
+    for(int i = 0; i < prio_num; i++) {
+        queue_init(&local_queue->ready_queue[i], capacity, latency_hist != NULL);
+    }
+    local_queue->latency_hist = latency_hist;
+    local_queue->prio_num = prio_num;
+    local_queue->ready_levels = 0;
+    local_queue->prio = prio_num - 1;
     local_queue->count = 0;
+    local_queue->error = 0;
+    local_queue->enqs = 0;
+    local_queue->deqs = 0;
+    local_queue->steals = 0;
+    local_queue->misses = 0;
+    local_queue->high_water = 0;
+    local_queue->batch_addr = 0;
+    local_queue->batch_size = 0;
+    local_queue->shm_addr = 0;
+    local_queue->shm_size = 0;
+    local_queue->sleep_deadline = 0;
+    memset(&local_queue->shm_ring, 0, sizeof(ShmRing));
 }
 
-void push_local_queue(LocalQueue* local_queue, uint64_t data, bool need_preempt) {
-    local_queue->count++;
+// 抢占任务插入最高优先级的队首，其余任务插入对应优先级的队尾
+bool push_local_queue(LocalQueue* local_queue, uint64_t data, uint64_t prio, bool need_preempt, int64_t stamp) {
+    bool ok = false;
+    if(prio == TAIC_PRIO_DEFAULT) {
+        prio = local_queue->prio;
+    } else if(prio >= local_queue->prio_num) {
+        prio = local_queue->prio_num - 1;
+    }
+    // 默认优先级的普通任务优先放入共享环形队列，客户机不需要陷入就可以取出
+    if(!need_preempt && prio == local_queue->prio && shm_ring_active(&local_queue->shm_ring) &&
+       shm_ring_push(&local_queue->shm_ring, data)) {
+        qatomic_set(&local_queue->enqs, local_queue->enqs + 1);
+        return true;
+    }
     if(need_preempt) {
-        queue_push_head(local_queue->ready_queue, data);
+        prio = 0;
+        ok = queue_push_head(&local_queue->ready_queue[prio], data, stamp);
     } else {
-        queue_push(local_queue->ready_queue, data);
+        ok = queue_push(&local_queue->ready_queue[prio], data, stamp);
+    }
+    if(!ok) {
+        qatomic_or(&local_queue->error, TAIC_ERR_QUEUE_FULL);
+        return false;
+    }
+    local_queue->ready_levels |= 1ULL << prio;
+    qatomic_set(&local_queue->count, local_queue->count + 1);
+    qatomic_set(&local_queue->enqs, local_queue->enqs + 1);
+    if(local_queue->count > local_queue->high_water) {
+        qatomic_set(&local_queue->high_water, local_queue->count);
     }
+    return true;
 }
 
-uint64_t pop_local_queue(LocalQueue* local_queue) {
-    if(local_queue->count > 0) {
-        local_queue->count--;
+// 取出最高优先级的任务，prio 不为 NULL 时返回任务所在的优先级
+uint64_t pop_local_queue(LocalQueue* local_queue, uint64_t* prio) {
+    if(local_queue->ready_levels == 0) {
+        return 0;
+    }
+    uint64_t level = ctz64(local_queue->ready_levels);
+    Queue* queue = &local_queue->ready_queue[level];
+    int64_t stamp = 0;
+    uint64_t res = queue_pop(queue, &stamp);
+    // 只有唤醒的任务带有时间戳
+    if(stamp != 0 && local_queue->latency_hist != NULL) {
+        int64_t delay = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - stamp;
+        qatomic_inc(&local_queue->latency_hist[63 - clz64(MAX(delay, 1))]);
+    }
+    if(queue_len(queue) == 0) {
+        local_queue->ready_levels &= ~(1ULL << level);
     }
-    return queue_pop(local_queue->ready_queue);
+    if(prio != NULL) {
+        *prio = level;
+    }
+    qatomic_set(&local_queue->count, local_queue->count - 1);
+    return res;
 }
 
-enum GQState {
-    GQ_IDLE = 0,
-    ALLOC_LQ = 1,
-    FREE_LQ = 2,
-    ENQ_LQ = 3,
-    DEQ_LQ = 4,
-    REG_EXT = 5,
-    HANDLE_EXT = 6,
-    HANDLE_SOFT = 7,
-};
+void clear_local_queue(LocalQueue* local_queue) {
+    for(int i = 0; i < local_queue->prio_num; i++) {
+        queue_clear(&local_queue->ready_queue[i]);
+    }
+    local_queue->ready_levels = 0;
+    local_queue->prio = local_queue->prio_num - 1;
+    qatomic_set(&local_queue->count, 0);
+    qatomic_set(&local_queue->error, 0);
+    local_queue->batch_addr = 0;
+    local_queue->batch_size = 0;
+    local_queue->shm_addr = 0;
+    local_queue->shm_size = 0;
+    local_queue->sleep_deadline = 0;
+    shm_ring_unmap(&local_queue->shm_ring);
+}
 
 enum SintState {
     SINT_IDLE = 0,
@@ -43,271 +111,604 @@ enum SintState {
     SINT_SEND_INTR = 5,
 };
 
-void init_global_queue(GlobalQueue* global_queue) {
+/*
+ * 并发模型：每个局部队列由自己的自旋锁保护，入队/出队只锁目标局部队列；
+ * 全局队列的锁只用于分配/释放局部队列以及软中断能力注册等控制路径。
+ */
+void init_global_queue(GlobalQueue* global_queue, uint32_t lq_num, uint32_t intr_num, uint32_t lq_capacity,
+                       uint32_t prio_num, uint32_t sleep_capacity, bool latency_hist) {
     int i = 0;
-    global_queue->state = 0;
+    qemu_spin_init(&global_queue->lock);
     global_queue->sint_state = 0;
     global_queue->os_id = 0;
     global_queue->proc_id = 0;
     global_queue->hart_id = -1;
+    global_queue->notified_hart = -1;
+    global_queue->hart_mask = NULL;
+    global_queue->hart_count = 0;
+    global_queue->notify_policy = TAIC_NOTIFY_FIXED;
+    global_queue->notify_cursor = 0;
     global_queue->ssip = false;
     global_queue->usip = false;
     global_queue->used_lq_count = 0;
-    global_queue->sendcap_idx = -1;
     global_queue->recv_os = 0;
     global_queue->recv_proc = 0;
-    global_queue->local_queue = g_new0(LocalQueue, LQ_NUM);
-    for(i = 0; i < LQ_NUM; i++) {
-        init_local_queue(&(global_queue->local_queue[i]));
+    global_queue->lq_num = lq_num;
+    global_queue->nonempty = bitmap_new(lq_num);
+    global_queue->shm_rings = bitmap_new(lq_num);
+    global_queue->steal_policy = TAIC_STEAL_FIRST;
+    global_queue->steal_default = TAIC_STEAL_FIRST;
+    global_queue->steal_cursor = 0;
+    global_queue->steal_seed = (uintptr_t)global_queue | 1;
+    global_queue->balance_cap = 0;
+    global_queue->migrations = 0;
+    global_queue->preemptions = 0;
+    global_queue->idle_notifies = 0;
+    global_queue->ext_delivered = 0;
+    global_queue->ext_dropped = 0;
+    global_queue->soft_delivered = 0;
+    global_queue->soft_dropped = 0;
+    global_queue->timer_wakeups = 0;
+    global_queue->timer_dropped = 0;
+    global_queue->latency_hist = latency_hist ? g_new0(uint64_t, TAIC_LATENCY_BUCKETS) : NULL;
+    global_queue->local_queue = g_new0(LocalQueue, lq_num);
+    for(i = 0; i < lq_num; i++) {
+        init_local_queue(&(global_queue->local_queue[i]), lq_capacity, prio_num, global_queue->latency_hist);
     }
-    init_extintrslots(&(global_queue->extintrslots), INTR_NUM);
-    init_softintrslots(&(global_queue->softintrslots), INTR_NUM);
+    init_extintrslots(&(global_queue->extintrslots), intr_num);
+    init_softintrslots(&(global_queue->softintrslots), intr_num);
+    sleepq_init(&(global_queue->sleepq), sleep_capacity);
 }
 
 int64_t alloc_lq(GlobalQueue* global_queue) {
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->state, GQ_IDLE, ALLOC_LQ);
-        if (state == GQ_IDLE) {
-            int64_t i = 0;
-            for(i = 0; i < LQ_NUM; i++) {
-                if(!global_queue->local_queue[i].is_used) {
-                    global_queue->local_queue[i].is_used = true;
-                    global_queue->used_lq_count += 1;
-                    qatomic_set(&global_queue->state, GQ_IDLE);
-                    return i;
-                }
-            }
-            // error_report("The is no local queue");
-            qatomic_set(&global_queue->state, GQ_IDLE);
-            return -1;
+    int64_t i = 0;
+    qemu_spin_lock(&global_queue->lock);
+    for(i = 0; i < global_queue->lq_num; i++) {
+        if(!global_queue->local_queue[i].is_used) {
+            qatomic_set(&global_queue->local_queue[i].is_used, true);
+            global_queue->used_lq_count += 1;
+            qemu_spin_unlock(&global_queue->lock);
+            return i;
         }
     }
+    // error_report("The is no local queue");
+    qemu_spin_unlock(&global_queue->lock);
+    return -1;
+}
+
+// 最后一个局部队列被释放时恢复全局队列的初始状态，调用者持有全局队列的锁
+static void gq_clear(GlobalQueue* global_queue) {
+    qatomic_set(&global_queue->os_id, 0);
+    qatomic_set(&global_queue->proc_id, 0);
+    qatomic_set(&global_queue->hart_id, -1);
+    qatomic_set(&global_queue->notified_hart, -1);
+    qatomic_set(&global_queue->notify_policy, TAIC_NOTIFY_FIXED);
+    qatomic_set(&global_queue->ssip, false);
+    qatomic_set(&global_queue->usip, false);
+    qatomic_set(&global_queue->steal_policy, global_queue->steal_default);
+    qatomic_set(&global_queue->balance_cap, 0);
+    sleepq_clear(&(global_queue->sleepq));
+    // 处理任务和待处理的中断不能留给下一个使用该全局队列的进程
+    global_queue->sint_state = 0;
+    clean_extintrslots(&(global_queue->extintrslots));
+    clean_softintrslots(&(global_queue->softintrslots));
+    for(int i = 0; i < global_queue->lq_num; i++) {
+        LocalQueue* local_queue = &(global_queue->local_queue[i]);
+        qemu_spin_lock(&local_queue->lock);
+        clear_local_queue(local_queue);
+        clear_bit_atomic(i, global_queue->nonempty);
+        clear_bit_atomic(i, global_queue->shm_rings);
+        qemu_spin_unlock(&local_queue->lock);
+    }
 }
 
 void free_lq(GlobalQueue* global_queue, uint64_t lq_idx) {
-    if(lq_idx >= LQ_NUM) {
+    if(lq_idx >= global_queue->lq_num) {
         // error_report("The lq_idx is not valid");
         return;
     }
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->state, GQ_IDLE, FREE_LQ);
-        if (state == GQ_IDLE) {
-            global_queue->local_queue[lq_idx].is_used = false;
-            global_queue->used_lq_count -= 1;
-            if(global_queue->used_lq_count == 0) {
-                global_queue->os_id = 0;
-                global_queue->proc_id = 0;
-                global_queue->hart_id = -1;
-                global_queue->ssip = false;
-                global_queue->usip = false;
-                for(int i = 0; i < LQ_NUM; i++) {
-                    while(global_queue->local_queue[i].count != 0) {
-                        pop_local_queue(&(global_queue->local_queue[i]));
-                    }
-                }
+    qemu_spin_lock(&global_queue->lock);
+    if(!global_queue->local_queue[lq_idx].is_used) {
+        qemu_spin_unlock(&global_queue->lock);
+        return;
+    }
+    qatomic_set(&global_queue->local_queue[lq_idx].is_used, false);
+    sleepq_cancel_lq(&(global_queue->sleepq), lq_idx);
+    global_queue->used_lq_count -= 1;
+    if(global_queue->used_lq_count == 0) {
+        gq_clear(global_queue);
+    }
+    qemu_spin_unlock(&global_queue->lock);
+}
+
+// 复位时释放全部局部队列，并清除中断槽和软中断能力
+void reset_global_queue(GlobalQueue* global_queue) {
+    qemu_spin_lock(&global_queue->lock);
+    for(int i = 0; i < global_queue->lq_num; i++) {
+        qatomic_set(&global_queue->local_queue[i].is_used, false);
+    }
+    global_queue->used_lq_count = 0;
+    global_queue->recv_os = 0;
+    global_queue->recv_proc = 0;
+    global_queue->steal_cursor = 0;
+    global_queue->notify_cursor = 0;
+    gq_clear(global_queue);
+    if(global_queue->hart_count > 0) {
+        bitmap_zero(global_queue->hart_mask, global_queue->hart_count);
+    }
+    qemu_spin_unlock(&global_queue->lock);
+}
+
+// 迁移后根据局部队列的内容恢复计数和位图，并重新映射共享环形队列
+void gq_post_load(GlobalQueue* global_queue) {
+    for(int i = 0; i < global_queue->lq_num; i++) {
+        LocalQueue* local_queue = &(global_queue->local_queue[i]);
+        local_queue->count = 0;
+        local_queue->ready_levels = 0;
+        for(int j = 0; j < local_queue->prio_num; j++) {
+            uint32_t len = queue_len(&local_queue->ready_queue[j]);
+            if(len != 0) {
+                local_queue->count += len;
+                local_queue->ready_levels |= 1ULL << j;
             }
-            qatomic_set(&global_queue->state, GQ_IDLE);
-            return;
+        }
+        if(local_queue->count != 0) {
+            set_bit(i, global_queue->nonempty);
+        } else {
+            clear_bit(i, global_queue->nonempty);
+        }
+        shm_ring_unmap(&local_queue->shm_ring);
+        if(local_queue->shm_size != 0 &&
+           !shm_ring_map(&local_queue->shm_ring, local_queue->shm_addr, local_queue->shm_size)) {
+            local_queue->shm_size = 0;
+            local_queue->error |= TAIC_ERR_SHM_RING;
+        }
+        if(shm_ring_active(&local_queue->shm_ring)) {
+            set_bit(i, global_queue->shm_rings);
+        } else {
+            clear_bit(i, global_queue->shm_rings);
         }
     }
 }
 
-void lq_enq(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t data, bool need_preempt) {
-    if(lq_idx >= LQ_NUM) {
+static bool lq_push(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t data, uint64_t prio,
+                    bool need_preempt, int64_t stamp) {
+    if(lq_idx >= global_queue->lq_num) {
         error_report("The lq_idx is not valid");
-        return;
+        return false;
     }
-    if(!global_queue->local_queue[lq_idx].is_used) {
+    LocalQueue* local_queue = &(global_queue->local_queue[lq_idx]);
+    if(!qatomic_read(&local_queue->is_used)) {
         error_report("The lq_idx is not used");
-        return;
+        return false;
     }
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->state, GQ_IDLE, ENQ_LQ);
-        if (state == GQ_IDLE || state == HANDLE_EXT || state == HANDLE_SOFT) {
-            push_local_queue(&(global_queue->local_queue[lq_idx]), data, need_preempt);
-            qatomic_set(&global_queue->state, GQ_IDLE);
-            return;
-        }
+    qemu_spin_lock(&local_queue->lock);
+    bool ok = push_local_queue(local_queue, data, prio, need_preempt, stamp);
+    if(ok && local_queue->count == 1) {
+        set_bit_atomic(lq_idx, global_queue->nonempty);
     }
+    qemu_spin_unlock(&local_queue->lock);
+    return ok;
 }
 
-uint64_t lq_deq(GlobalQueue* global_queue, uint64_t lq_idx) {
-    if(lq_idx >= LQ_NUM) {
+bool lq_enq(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t data, uint64_t prio, bool need_preempt) {
+    return lq_push(global_queue, lq_idx, data, prio, need_preempt, 0);
+}
+
+// 把被唤醒的处理任务放入局部队列的最高优先级，需要时记录唤醒时间
+static bool lq_wakeup(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t handler, bool need_preempt) {
+    int64_t stamp = global_queue->latency_hist != NULL ? qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) : 0;
+    return lq_push(global_queue, lq_idx, handler, 0, need_preempt, stamp);
+}
+
+// 处理任务的第 0 位表示需要抢占，根据全局队列属于内核还是用户进程选择软件中断
+static bool gq_need_preempt(GlobalQueue* global_queue, uint64_t handler) {
+    if(!(handler & TAIC_HANDLER_PREEMPT)) {
+        return false;
+    }
+    qatomic_inc(&global_queue->preemptions);
+    if(qatomic_read(&global_queue->proc_id) == 0) {
+        qatomic_set(&global_queue->ssip, true);
+    } else {
+        qatomic_set(&global_queue->usip, true);
+    }
+    return true;
+}
+
+uint64_t lq_enq_batch(GlobalQueue* global_queue, uint64_t lq_idx, const uint64_t* data, uint64_t n) {
+    if(lq_idx >= global_queue->lq_num) {
         error_report("The lq_idx is not valid");
         return 0;
     }
-    if(!global_queue->local_queue[lq_idx].is_used) {
+    LocalQueue* local_queue = &(global_queue->local_queue[lq_idx]);
+    if(!qatomic_read(&local_queue->is_used)) {
         error_report("The lq_idx is not used");
         return 0;
     }
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->state, GQ_IDLE, DEQ_LQ);
-        if (state == GQ_IDLE) {
-            if(global_queue->ssip == true || global_queue->usip == true) {
-                lq_idx = 0;
-                global_queue->ssip = false;
-                global_queue->usip = false;
-            }
-            uint64_t res = pop_local_queue(&(global_queue->local_queue[lq_idx]));
-            if(res == 0) {
-                // 从其他的局部队列中窃取任务
-                for(int i = 0; i < LQ_NUM; i++) {
-                    if(global_queue->local_queue[i].count != 0) {
-                        res = pop_local_queue(&(global_queue->local_queue[i]));
-                        break;
-                    }
-                }
-            }
-            qatomic_set(&global_queue->state, GQ_IDLE);
-            return res;
+    uint64_t i = 0;
+    qemu_spin_lock(&local_queue->lock);
+    for(i = 0; i < n; i++) {
+        if(!push_local_queue(local_queue, data[i], TAIC_PRIO_DEFAULT, false, 0)) {
+            break;
         }
     }
+    if(local_queue->count != 0) {
+        set_bit_atomic(lq_idx, global_queue->nonempty);
+    }
+    qemu_spin_unlock(&local_queue->lock);
+    return i;
 }
 
-void register_ext_handler(GlobalQueue* global_queue, uint64_t irq_idx, uint64_t data) {
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->state, GQ_IDLE, REG_EXT);
-        if(state == GQ_IDLE) {
-            register_ext(&(global_queue->extintrslots), irq_idx, data);
-            qatomic_set(&global_queue->state, GQ_IDLE);
-            return;
+// 从一个局部队列中最多取出 n 个任务
+static uint64_t lq_try_pop(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t* data, uint64_t n) {
+    LocalQueue* local_queue = &(global_queue->local_queue[lq_idx]);
+    uint64_t i = 0;
+    // 无锁地检查是否为空，避免空队列上的锁竞争
+    if(qatomic_read(&local_queue->count) == 0 && !shm_ring_active(&local_queue->shm_ring)) {
+        return 0;
+    }
+    qemu_spin_lock(&local_queue->lock);
+    for(i = 0; i < n && local_queue->count != 0; i++) {
+        data[i] = pop_local_queue(local_queue, NULL);
+    }
+    // 抢占任务取完之后再从共享环形队列中取
+    while(i < n && shm_ring_active(&local_queue->shm_ring) &&
+          shm_ring_pop(&local_queue->shm_ring, &data[i])) {
+        i++;
+    }
+    qatomic_set(&local_queue->deqs, local_queue->deqs + i);
+    if(local_queue->count == 0) {
+        clear_bit_atomic(lq_idx, global_queue->nonempty);
+    }
+    qemu_spin_unlock(&local_queue->lock);
+    return i;
+}
+
+static uint64_t steal_random(GlobalQueue* global_queue) {
+    // xorshift64，并发更新时丢失一次状态也无妨
+    uint64_t x = qatomic_read(&global_queue->steal_seed);
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    qatomic_set(&global_queue->steal_seed, x);
+    return x;
+}
+
+// 从 victim 中取出一半的任务，前 n 个返回给调用者，其余的放入 thief；
+// 共享环形队列中的任务也计算在内，在 ready_queue 取完之后取出
+static uint64_t lq_steal_half(GlobalQueue* global_queue, uint64_t thief_idx, uint64_t victim_idx,
+                              uint64_t* data, uint64_t n) {
+    LocalQueue* victim = &(global_queue->local_queue[victim_idx]);
+    LocalQueue* thief = &(global_queue->local_queue[thief_idx]);
+    uint64_t buf[TAIC_STEAL_HALF_MAX];
+    uint64_t prio[TAIC_STEAL_HALF_MAX];
+    uint64_t i = 0;
+    uint64_t k = 0;
+    qemu_spin_lock(&victim->lock);
+    bool shm = shm_ring_active(&victim->shm_ring);
+    uint64_t total = victim->count + (shm ? shm_ring_len(&victim->shm_ring) : 0);
+    uint64_t want = MIN(DIV_ROUND_UP(total, 2), TAIC_STEAL_HALF_MAX);
+    for(k = 0; k < want && victim->count != 0; k++) {
+        buf[k] = pop_local_queue(victim, &prio[k]);
+    }
+    while(k < want && shm && shm_ring_pop(&victim->shm_ring, &buf[k])) {
+        prio[k] = victim->prio;
+        k++;
+    }
+    if(victim->count == 0) {
+        clear_bit_atomic(victim_idx, global_queue->nonempty);
+    }
+    qemu_spin_unlock(&victim->lock);
+    uint64_t res = MIN(k, n);
+    memcpy(data, buf, res * sizeof(uint64_t));
+    if(res == k) {
+        return res;
+    }
+    // 同一时刻只持有一个局部队列的锁
+    qemu_spin_lock(&thief->lock);
+    for(i = res; i < k; i++) {
+        if(!push_local_queue(thief, buf[i], prio[i], false, 0)) {
+            break;
         }
     }
+    if(thief->count != 0) {
+        set_bit_atomic(thief_idx, global_queue->nonempty);
+    }
+    qemu_spin_unlock(&thief->lock);
+    // 放不下的任务还给 victim
+    for(; i < k; i++) {
+        lq_enq(global_queue, victim_idx, buf[i], prio[i], false);
+    }
+    return res;
 }
 
-void handle_extintr(GlobalQueue* global_queue, uint64_t irq_idx) {
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->state, GQ_IDLE, HANDLE_EXT);
-        if(state == GQ_IDLE) {
-            uint64_t ext_handler = wakeup_ext(&(global_queue->extintrslots), irq_idx);
-            if(ext_handler == 0) {
-                qatomic_set(&global_queue->state, GQ_IDLE);
-                return;
-            }
-            bool need_preempt = false;
-            if((ext_handler & 1) == 1) {     // preempt
-                need_preempt = true;
-                if(global_queue->proc_id == 0) {
-                    global_queue->ssip = true;
+// 下一个可能有任务的局部队列：ready_queue 非空，或者映射了共享环形队列
+static uint64_t gq_next_victim(GlobalQueue* global_queue, uint64_t end, uint64_t start) {
+    uint64_t i = find_next_bit(global_queue->nonempty, end, start);
+    uint64_t j = find_next_bit(global_queue->shm_rings, end, start);
+    return MIN(i, j);
+}
+
+// 按照全局队列的窃取策略从其他的局部队列中窃取任务，只访问可能有任务的局部队列
+static uint64_t lq_steal(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t* data, uint64_t n) {
+    uint64_t policy = qatomic_read(&global_queue->steal_policy);
+    uint64_t lq_num = global_queue->lq_num;
+    uint64_t start = 0;
+    switch(policy & TAIC_STEAL_VICTIM_MASK) {
+    case TAIC_STEAL_DISABLED:
+        return 0;
+    case TAIC_STEAL_ROUND_ROBIN:
+        start = qatomic_fetch_inc(&global_queue->steal_cursor) % lq_num;
+        break;
+    case TAIC_STEAL_RANDOM:
+        start = steal_random(global_queue) % lq_num;
+        break;
+    default:
+        start = 0;
+        break;
+    }
+    uint64_t res = 0;
+    // 先扫描 [start, lq_num)，再回绕扫描 [0, start)
+    for(int pass = 0; pass < 2 && res < n; pass++) {
+        uint64_t end = pass == 0 ? lq_num : start;
+        uint64_t i = gq_next_victim(global_queue, end, pass == 0 ? start : 0);
+        while(i < end && res < n) {
+            if(i != lq_idx) {
+                if(policy & TAIC_STEAL_HALF) {
+                    res = lq_steal_half(global_queue, lq_idx, i, data, n);
+                    if(res != 0) {
+                        return res;
+                    }
                 } else {
-                    global_queue->usip = true;
+                    res += lq_try_pop(global_queue, i, data + res, n - res);
                 }
             }
-            lq_enq(global_queue, 0, ext_handler, need_preempt);
-            return;
+            i = gq_next_victim(global_queue, end, i + 1);
+        }
+    }
+    return res;
+}
+
+uint64_t lq_deq_batch(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t* data, uint64_t n) {
+    if(lq_idx >= global_queue->lq_num) {
+        error_report("The lq_idx is not valid");
+        return 0;
+    }
+    if(!qatomic_read(&global_queue->local_queue[lq_idx].is_used)) {
+        error_report("The lq_idx is not used");
+        return 0;
+    }
+    bool ssip = qatomic_xchg(&global_queue->ssip, false);
+    bool usip = qatomic_xchg(&global_queue->usip, false);
+    if(ssip || usip) {
+        lq_idx = 0;
+    }
+    uint64_t res = lq_try_pop(global_queue, lq_idx, data, n);
+    if(res == 0) {
+        LocalQueue* local_queue = &(global_queue->local_queue[lq_idx]);
+        res = lq_steal(global_queue, lq_idx, data, n);
+        if(res != 0) {
+            qatomic_inc(&local_queue->steals);
+        } else {
+            qatomic_inc(&local_queue->misses);
+        }
+    }
+    return res;
+}
+
+// 供其他全局队列迁移任务，不消耗该全局队列的抢占标志，也不计入窃取统计
+uint64_t gq_steal(GlobalQueue* global_queue, uint64_t* data, uint64_t n) {
+    uint64_t lq_num = global_queue->lq_num;
+    uint64_t res = 0;
+    uint64_t i = gq_next_victim(global_queue, lq_num, 0);
+    while(i < lq_num && res < n) {
+        res += lq_try_pop(global_queue, i, data + res, n - res);
+        i = gq_next_victim(global_queue, lq_num, i + 1);
+    }
+    return res;
+}
+
+uint64_t lq_deq(GlobalQueue* global_queue, uint64_t lq_idx) {
+    uint64_t res = 0;
+    lq_deq_batch(global_queue, lq_idx, &res, 1);
+    return res;
+}
+
+uint64_t lq_read_error(GlobalQueue* global_queue, uint64_t lq_idx) {
+    if(lq_idx >= global_queue->lq_num) {
+        error_report("The lq_idx is not valid");
+        return 0;
+    }
+    // 读清除
+    return qatomic_xchg(&global_queue->local_queue[lq_idx].error, 0);
+}
+
+// size 为 0 时解除映射，共享环形队列的地址由 shm_addr 给出
+bool lq_map_shm_ring(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t size) {
+    if(lq_idx >= global_queue->lq_num) {
+        error_report("The lq_idx is not valid");
+        return false;
+    }
+    LocalQueue* local_queue = &(global_queue->local_queue[lq_idx]);
+    bool ok = true;
+    qemu_spin_lock(&local_queue->lock);
+    shm_ring_unmap(&local_queue->shm_ring);
+    if(size != 0) {
+        ok = shm_ring_map(&local_queue->shm_ring, local_queue->shm_addr, size);
+    }
+    local_queue->shm_size = ok ? size : 0;
+    if(shm_ring_active(&local_queue->shm_ring)) {
+        set_bit_atomic(lq_idx, global_queue->shm_rings);
+    } else {
+        clear_bit_atomic(lq_idx, global_queue->shm_rings);
+    }
+    qemu_spin_unlock(&local_queue->lock);
+    return ok;
+}
+
+// 中断处理任务进入 0 号局部队列的最高优先级，不需要抢占也能排在普通任务之前；
+// count 个待处理的事件各唤醒一次，队列满后剩余的事件计入 dropped
+static bool gq_wakeup_handler(GlobalQueue* global_queue, uint64_t handler, uint64_t count,
+                              uint64_t* delivered, uint64_t* dropped) {
+    bool need_preempt = gq_need_preempt(global_queue, handler);
+    for(uint64_t i = 0; i < count; i++) {
+        if(!lq_wakeup(global_queue, 0, handler, need_preempt)) {
+            qatomic_add(dropped, count - i);
+            break;
         }
+        qatomic_inc(delivered);
     }
+    return need_preempt;
+}
+
+// 返回是否唤醒了需要抢占的处理任务
+bool register_ext_handler(GlobalQueue* global_queue, uint64_t irq_idx, uint64_t data) {
+    uint64_t count = register_ext(&(global_queue->extintrslots), irq_idx, data);
+    if(count == 0) {
+        return false;
+    }
+    trace_taic_wakeup_ext(global_queue->os_id, global_queue->proc_id, irq_idx, data);
+    return gq_wakeup_handler(global_queue, data, count, &global_queue->ext_delivered,
+                             &global_queue->ext_dropped);
+}
+
+// 返回是否唤醒了需要抢占的处理任务，只有这时才需要发出软件中断
+bool handle_extintr(GlobalQueue* global_queue, uint64_t irq_idx) {
+    uint64_t ext_handler = wakeup_ext(&(global_queue->extintrslots), irq_idx);
+    if(ext_handler == 0) {
+        return false;
+    }
+    trace_taic_wakeup_ext(global_queue->os_id, global_queue->proc_id, irq_idx, ext_handler);
+    return gq_wakeup_handler(global_queue, ext_handler, 1, &global_queue->ext_delivered,
+                             &global_queue->ext_dropped);
 }
 
 void register_sender(GlobalQueue* global_queue, uint64_t data) {
-    uint64_t state = 0;
     while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->sint_state, SINT_IDLE, SINT_REG_SEND);
-        if(state == SINT_IDLE) {
+        qemu_spin_lock(&global_queue->lock);
+        if(global_queue->sint_state == SINT_IDLE) {
+            global_queue->sint_state = SINT_REG_SEND;
             register_send(&(global_queue->softintrslots), data);
+            qemu_spin_unlock(&global_queue->lock);
             return;
-        } else if(state == SINT_REG_SEND) {
+        } else if(global_queue->sint_state == SINT_REG_SEND) {
             register_send(&(global_queue->softintrslots), data);
-            qatomic_set(&global_queue->sint_state, SINT_IDLE);
+            global_queue->sint_state = SINT_IDLE;
+            qemu_spin_unlock(&global_queue->lock);
             return;
         }
+        qemu_spin_unlock(&global_queue->lock);
     }
 }
 
 void cancel_sender(GlobalQueue* global_queue, uint64_t data) {
-    uint64_t state = 0;
     while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->sint_state, SINT_IDLE, SINT_CANCEL_SEND);
-        if(state == SINT_IDLE) {
+        qemu_spin_lock(&global_queue->lock);
+        if(global_queue->sint_state == SINT_IDLE) {
+            global_queue->sint_state = SINT_CANCEL_SEND;
             cancel_send(&(global_queue->softintrslots), data);
+            qemu_spin_unlock(&global_queue->lock);
             return;
-        } else if(state == SINT_CANCEL_SEND) {
+        } else if(global_queue->sint_state == SINT_CANCEL_SEND) {
             cancel_send(&(global_queue->softintrslots), data);
-            qatomic_set(&global_queue->sint_state, SINT_IDLE);
+            global_queue->sint_state = SINT_IDLE;
+            qemu_spin_unlock(&global_queue->lock);
             return;
         }
+        qemu_spin_unlock(&global_queue->lock);
     }
 }
 
-void register_receiver(GlobalQueue* global_queue, uint64_t data) {
-    uint64_t state = 0;
+// 第三次写入完成注册，返回是否唤醒了需要抢占的处理任务
+bool register_receiver(GlobalQueue* global_queue, uint64_t data) {
     while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->sint_state, SINT_IDLE, SINT_REG_RECV0);
-        if(state == SINT_IDLE) {
+        qemu_spin_lock(&global_queue->lock);
+        if(global_queue->sint_state == SINT_IDLE) {
+            global_queue->sint_state = SINT_REG_RECV0;
             register_recv(&(global_queue->softintrslots), data);
-            return;
-        } else if(state == SINT_REG_RECV0) {
+            qemu_spin_unlock(&global_queue->lock);
+            return false;
+        } else if(global_queue->sint_state == SINT_REG_RECV0) {
             register_recv(&(global_queue->softintrslots), data);
-            qatomic_set(&global_queue->sint_state, SINT_REG_RECV1);
-            return;
-        } else if(state == SINT_REG_RECV1) {
-            register_recv(&(global_queue->softintrslots), data);
-            qatomic_set(&global_queue->sint_state, SINT_IDLE);
-            return;
+            global_queue->sint_state = SINT_REG_RECV1;
+            qemu_spin_unlock(&global_queue->lock);
+            return false;
+        } else if(global_queue->sint_state == SINT_REG_RECV1) {
+            uint64_t send_os = global_queue->softintrslots.os_id;
+            uint64_t send_proc = global_queue->softintrslots.proc_id;
+            uint64_t count = register_recv(&(global_queue->softintrslots), data);
+            global_queue->sint_state = SINT_IDLE;
+            qemu_spin_unlock(&global_queue->lock);
+            if(count == 0) {
+                return false;
+            }
+            trace_taic_wakeup_soft(global_queue->os_id, global_queue->proc_id, send_os, send_proc, data);
+            return gq_wakeup_handler(global_queue, data, count, &global_queue->soft_delivered,
+                                     &global_queue->soft_dropped);
         }
+        qemu_spin_unlock(&global_queue->lock);
     }
 }
 
-void check_sendcap(GlobalQueue* global_queue, uint64_t data) {
-    uint64_t state = 0;
+bool check_sendcap(GlobalQueue* global_queue, uint64_t data, uint64_t* recv_os, uint64_t* recv_proc) {
     while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->sint_state, SINT_IDLE, SINT_SEND_INTR);
-        if(state == SINT_IDLE) {
+        qemu_spin_lock(&global_queue->lock);
+        if(global_queue->sint_state == SINT_IDLE) {
+            global_queue->sint_state = SINT_SEND_INTR;
             global_queue->recv_os = data;
-            return;
-        } else if(state == SINT_SEND_INTR) {
+            qemu_spin_unlock(&global_queue->lock);
+            return false;
+        } else if(global_queue->sint_state == SINT_SEND_INTR) {
             global_queue->recv_proc = data;
-            uint64_t recv_os = global_queue->recv_os;
-            uint64_t recv_proc = data;
-            global_queue->sendcap_idx = check_send(&(global_queue->softintrslots), recv_os, recv_proc);
-            qatomic_set(&global_queue->sint_state, SINT_IDLE);
-            return;
+            *recv_os = global_queue->recv_os;
+            *recv_proc = data;
+            bool has_cap = check_send(&(global_queue->softintrslots), *recv_os, *recv_proc) != -1;
+            global_queue->sint_state = SINT_IDLE;
+            qemu_spin_unlock(&global_queue->lock);
+            return has_cap;
         }
+        qemu_spin_unlock(&global_queue->lock);
     }
 }
 
-void handle_softintr(GlobalQueue* global_queue, uint64_t send_os, uint64_t send_proc) {
-    uint64_t state = 0;
-    while (1) {
-        /* code */
-        state = qatomic_cmpxchg(&global_queue->state, GQ_IDLE, HANDLE_SOFT);
-        if(state == GQ_IDLE) {
-            uint64_t soft_handler = wakeup_soft(&(global_queue->softintrslots), send_os, send_proc);
-            if(soft_handler == 0) {
-                qatomic_set(&global_queue->state, GQ_IDLE);
-                return;
-            }
-            bool need_preempt = false;
-            if((soft_handler & 1) == 1) {     // preempt
-                need_preempt = true;
-                if(global_queue->proc_id == 0) {
-                    global_queue->ssip = true;
-                } else {
-                    global_queue->usip = true;
-                }
-            }
-            lq_enq(global_queue, 0, soft_handler, need_preempt);
-            return;
-        }
+bool handle_softintr(GlobalQueue* global_queue, uint64_t send_os, uint64_t send_proc) {
+    uint64_t soft_handler = wakeup_soft(&(global_queue->softintrslots), send_os, send_proc);
+    if(soft_handler == 0) {
+        return false;
     }
+    trace_taic_wakeup_soft(global_queue->os_id, global_queue->proc_id, send_os, send_proc, soft_handler);
+    return gq_wakeup_handler(global_queue, soft_handler, 1, &global_queue->soft_delivered,
+                             &global_queue->soft_dropped);
 }
 
 void write_hartid(GlobalQueue* global_queue, uint64_t data) {
-    global_queue->hart_id = data;
+    qatomic_set(&global_queue->hart_id, data);
+}
+
+bool register_sleep(GlobalQueue* global_queue, uint64_t lq_idx, int64_t deadline, uint64_t task) {
+    if(lq_idx >= global_queue->lq_num) {
+        return false;
+    }
+    return sleepq_push(&(global_queue->sleepq), deadline, task, lq_idx);
+}
+
+void cancel_sleep(GlobalQueue* global_queue, uint64_t task) {
+    sleepq_cancel(&(global_queue->sleepq), task);
+}
+
+// 唤醒所有截止时间不晚于 now 的任务，返回是否唤醒了需要抢占的任务
+bool handle_timer(GlobalQueue* global_queue, int64_t now) {
+    bool need_preempt = false;
+    SleepEntry entry;
+    while(sleepq_pop_expired(&(global_queue->sleepq), now, &entry)) {
+        trace_taic_wakeup_timer(global_queue->os_id, global_queue->proc_id, entry.lq_idx, entry.task);
+        bool preempt = gq_need_preempt(global_queue, entry.task);
+        if(lq_wakeup(global_queue, entry.lq_idx, entry.task, preempt)) {
+            qatomic_inc(&global_queue->timer_wakeups);
+        } else {
+            qatomic_inc(&global_queue->timer_dropped);
+        }
+        need_preempt |= preempt;
+    }
+    return need_preempt;
 }
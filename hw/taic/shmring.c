@@ -0,0 +1,137 @@
+#include "hw/taic.h"
+#include "qemu/log.h"
+#include "qemu/rcu.h"
+#include "exec/address-spaces.h"
+
+/*
+ * 共享内存环形队列，位于客户机内存中，布局与 virtqueue 类似：
+ *
+ *   0x00  enq_pos   生产者位置
+ *   0x40  deq_pos   消费者位置
+ *   0x80  cells[size]，每个单元为 { uint64_t seq; uint64_t data; }
+ *
+ * 所有字段均为小端。客户机在启用前把 enq_pos/deq_pos 清零，并把 cells[i].seq 初始化为 i。
+ * 入队/出队使用 Vyukov 的有界 MPMC 算法，客户机和 TAIC 都可以作为生产者和消费者，
+ * 客户机的入队和出队不需要陷入 TAIC。
+ */
+#define SHM_RING_ENQ_POS    0x00
+#define SHM_RING_DEQ_POS    0x40
+#define SHM_RING_CELLS      0x80
+// 环形队列位于客户机内存中，限制重试次数，避免被客户机破坏的队列卡住 TAIC
+#define SHM_RING_MAX_RETRY  64
+
+typedef struct {
+    uint64_t seq;
+    uint64_t data;
+} ShmCell;
+
+static inline uint64_t* shm_ring_pos(ShmRing* ring, uint64_t off) {
+    return (uint64_t*)(ring->base + off);
+}
+
+static inline ShmCell* shm_ring_cell(ShmRing* ring, uint64_t pos) {
+    return (ShmCell*)(ring->base + SHM_RING_CELLS) + (pos & ring->mask);
+}
+
+// TAIC 直接写入了客户机内存，需要通知脏页跟踪
+static inline void shm_ring_dirty(ShmRing* ring, uint64_t pos_off, uint64_t pos) {
+    memory_region_set_dirty(ring->mr, ring->offset + pos_off, sizeof(uint64_t));
+    memory_region_set_dirty(ring->mr, ring->offset + SHM_RING_CELLS + (pos & ring->mask) * sizeof(ShmCell),
+                            sizeof(ShmCell));
+}
+
+bool shm_ring_map(ShmRing* ring, hwaddr addr, uint64_t size) {
+#if HOST_BIG_ENDIAN
+    qemu_log_mask(LOG_UNIMP, "taic: shared rings are not supported on big endian hosts\n");
+    return false;
+#else
+    if(!is_power_of_2(size) || size > TAIC_SHM_RING_MAX || (addr & (SHM_RING_DEQ_POS - 1)) != 0) {
+        return false;
+    }
+    hwaddr len = SHM_RING_CELLS + size * sizeof(ShmCell);
+    hwaddr plen = len;
+    hwaddr xlat = 0;
+    RCU_READ_LOCK_GUARD();
+    MemoryRegion* mr = address_space_translate(&address_space_memory, addr, &xlat, &plen,
+                                               true, MEMTXATTRS_UNSPECIFIED);
+    // 只能映射连续的可写 RAM
+    if(!memory_region_is_ram(mr) || memory_region_is_rom(mr) || plen < len) {
+        return false;
+    }
+    memory_region_ref(mr);
+    ring->mr = mr;
+    ring->offset = xlat;
+    ring->mask = size - 1;
+    qatomic_set(&ring->base, (uint8_t*)memory_region_get_ram_ptr(mr) + xlat);
+    return true;
+#endif
+}
+
+void shm_ring_unmap(ShmRing* ring) {
+    if(ring->base == NULL) {
+        return;
+    }
+    qatomic_set(&ring->base, NULL);
+    memory_region_unref(ring->mr);
+    ring->mr = NULL;
+    ring->offset = 0;
+    ring->mask = 0;
+}
+
+bool shm_ring_push(ShmRing* ring, uint64_t data) {
+    uint64_t* enq_pos = shm_ring_pos(ring, SHM_RING_ENQ_POS);
+    uint64_t pos = qatomic_read(enq_pos);
+    for(int i = 0; i < SHM_RING_MAX_RETRY; i++) {
+        ShmCell* cell = shm_ring_cell(ring, pos);
+        int64_t diff = (int64_t)(qatomic_load_acquire(&cell->seq) - pos);
+        if(diff == 0) {
+            uint64_t old = qatomic_cmpxchg(enq_pos, pos, pos + 1);
+            if(old == pos) {
+                qatomic_set(&cell->data, data);
+                qatomic_store_release(&cell->seq, pos + 1);
+                shm_ring_dirty(ring, SHM_RING_ENQ_POS, pos);
+                return true;
+            }
+            pos = old;
+        } else if(diff < 0) {   // 队列已满
+            return false;
+        } else {
+            pos = qatomic_read(enq_pos);
+        }
+    }
+    return false;
+}
+
+// 环形队列中的任务数，客户机可能同时在入队和出队，结果只是一个估计
+uint64_t shm_ring_len(ShmRing* ring) {
+    uint64_t enq = qatomic_read(shm_ring_pos(ring, SHM_RING_ENQ_POS));
+    uint64_t deq = qatomic_read(shm_ring_pos(ring, SHM_RING_DEQ_POS));
+    if((int64_t)(enq - deq) <= 0) {
+        return 0;
+    }
+    return MIN(enq - deq, ring->mask + 1);
+}
+
+bool shm_ring_pop(ShmRing* ring, uint64_t* data) {
+    uint64_t* deq_pos = shm_ring_pos(ring, SHM_RING_DEQ_POS);
+    uint64_t pos = qatomic_read(deq_pos);
+    for(int i = 0; i < SHM_RING_MAX_RETRY; i++) {
+        ShmCell* cell = shm_ring_cell(ring, pos);
+        int64_t diff = (int64_t)(qatomic_load_acquire(&cell->seq) - (pos + 1));
+        if(diff == 0) {
+            uint64_t old = qatomic_cmpxchg(deq_pos, pos, pos + 1);
+            if(old == pos) {
+                *data = qatomic_read(&cell->data);
+                qatomic_store_release(&cell->seq, pos + ring->mask + 1);
+                shm_ring_dirty(ring, SHM_RING_DEQ_POS, pos);
+                return true;
+            }
+            pos = old;
+        } else if(diff < 0) {   // 队列为空
+            return false;
+        } else {
+            pos = qatomic_read(deq_pos);
+        }
+    }
+    return false;
+}
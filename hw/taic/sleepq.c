@@ -0,0 +1,140 @@
+#include "hw/taic.h"
+
+/*
+ * 睡眠队列是按截止时间排列的最小堆，容量固定。lock 保护整个堆，
+ * 注册和到期都是 O(log n) 的操作，取消需要线性查找任务。
+ */
+void sleepq_init(SleepQueue* sleepq, uint32_t cap) {
+    qemu_spin_init(&sleepq->lock);
+    sleepq->cap = cap;
+    sleepq->count = 0;
+    sleepq->heap = g_new0(SleepEntry, cap);
+}
+
+static inline void sleepq_swap(SleepQueue* sleepq, uint32_t a, uint32_t b) {
+    SleepEntry tmp = sleepq->heap[a];
+    sleepq->heap[a] = sleepq->heap[b];
+    sleepq->heap[b] = tmp;
+}
+
+static void sleepq_sift_up(SleepQueue* sleepq, uint32_t i) {
+    while(i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if(sleepq->heap[parent].deadline <= sleepq->heap[i].deadline) {
+            break;
+        }
+        sleepq_swap(sleepq, parent, i);
+        i = parent;
+    }
+}
+
+static void sleepq_sift_down(SleepQueue* sleepq, uint32_t i) {
+    while(1) {
+        uint32_t min = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = left + 1;
+        if(left < sleepq->count && sleepq->heap[left].deadline < sleepq->heap[min].deadline) {
+            min = left;
+        }
+        if(right < sleepq->count && sleepq->heap[right].deadline < sleepq->heap[min].deadline) {
+            min = right;
+        }
+        if(min == i) {
+            return;
+        }
+        sleepq_swap(sleepq, min, i);
+        i = min;
+    }
+}
+
+// 删除第 i 个表项，调用者持有 lock
+static void sleepq_remove_at(SleepQueue* sleepq, uint32_t i) {
+    sleepq->count--;
+    if(i == sleepq->count) {
+        return;
+    }
+    sleepq->heap[i] = sleepq->heap[sleepq->count];
+    sleepq_sift_up(sleepq, i);
+    sleepq_sift_down(sleepq, i);
+}
+
+bool sleepq_push(SleepQueue* sleepq, int64_t deadline, uint64_t task, uint32_t lq_idx) {
+    qemu_spin_lock(&sleepq->lock);
+    if(sleepq->count == sleepq->cap) {
+        qemu_spin_unlock(&sleepq->lock);
+        return false;
+    }
+    SleepEntry* entry = &(sleepq->heap[sleepq->count]);
+    entry->deadline = deadline;
+    entry->task = task;
+    entry->lq_idx = lq_idx;
+    sleepq->count++;
+    sleepq_sift_up(sleepq, sleepq->count - 1);
+    qemu_spin_unlock(&sleepq->lock);
+    return true;
+}
+
+// 返回最早的截止时间，睡眠队列为空时返回 false
+bool sleepq_next(SleepQueue* sleepq, int64_t* deadline) {
+    qemu_spin_lock(&sleepq->lock);
+    bool res = sleepq->count != 0;
+    if(res) {
+        *deadline = sleepq->heap[0].deadline;
+    }
+    qemu_spin_unlock(&sleepq->lock);
+    return res;
+}
+
+// 取出一个截止时间不晚于 now 的表项
+bool sleepq_pop_expired(SleepQueue* sleepq, int64_t now, SleepEntry* entry) {
+    qemu_spin_lock(&sleepq->lock);
+    if(sleepq->count == 0 || sleepq->heap[0].deadline > now) {
+        qemu_spin_unlock(&sleepq->lock);
+        return false;
+    }
+    *entry = sleepq->heap[0];
+    sleepq_remove_at(sleepq, 0);
+    qemu_spin_unlock(&sleepq->lock);
+    return true;
+}
+
+// 取消任务最早的一次睡眠
+bool sleepq_cancel(SleepQueue* sleepq, uint64_t task) {
+    int64_t found = -1;
+    qemu_spin_lock(&sleepq->lock);
+    for(uint32_t i = 0; i < sleepq->count; i++) {
+        if(sleepq->heap[i].task == task &&
+           (found == -1 || sleepq->heap[i].deadline < sleepq->heap[found].deadline)) {
+            found = i;
+        }
+    }
+    if(found != -1) {
+        sleepq_remove_at(sleepq, found);
+    }
+    qemu_spin_unlock(&sleepq->lock);
+    return found != -1;
+}
+
+// 局部队列被释放时取消所有唤醒到该局部队列的任务，保留的表项压缩到前面后重新建堆
+void sleepq_cancel_lq(SleepQueue* sleepq, uint32_t lq_idx) {
+    qemu_spin_lock(&sleepq->lock);
+    uint32_t n = 0;
+    for(uint32_t i = 0; i < sleepq->count; i++) {
+        if(sleepq->heap[i].lq_idx != lq_idx) {
+            sleepq->heap[n++] = sleepq->heap[i];
+        }
+    }
+    if(n != sleepq->count) {
+        sleepq->count = n;
+        for(uint32_t i = n / 2; i-- > 0;) {
+            sleepq_sift_down(sleepq, i);
+        }
+    }
+    qemu_spin_unlock(&sleepq->lock);
+}
+
+void sleepq_clear(SleepQueue* sleepq) {
+    qemu_spin_lock(&sleepq->lock);
+    sleepq->count = 0;
+    qemu_spin_unlock(&sleepq->lock);
+}
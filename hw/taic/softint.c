@@ -6,174 +6,164 @@ enum state {
     REG_RECV0 = 2,
     REG_RECV1 = 3,
     CANCEL_SEND0 = 4,
-    WAKEUP = 5,
-    CLEAN = 6,
-    CHECK_SEND = 7,
 };
 
+/*
+ * lock 保护能力表以及多次写入的注册协议的状态，
+ * check_send 和 wakeup_soft 只访问能力表，不需要等待注册协议结束。
+ * 接收方还没有为发送方注册处理任务时，软件中断记录在 pendcap 中，注册时一并返回。
+ */
 void init_softintrslots(SoftIntrSlots* softintrslots, uint64_t size) {
+    qemu_spin_init(&softintrslots->lock);
     softintrslots->state = 0;
     softintrslots->cap = size;
-    softintrslots->sendcap = g_new0(SendCap, size);
-    softintrslots->recvcap = g_new0(RecvCap, size);
+    captable_init(&softintrslots->sendcap, size);
+    captable_init(&softintrslots->recvcap, size);
+    captable_init(&softintrslots->pendcap, size);
 }
 
 void register_send(SoftIntrSlots* softintrslots, uint64_t data) {
-    uint64_t state = 0;
     while(1) {
-        state = qatomic_cmpxchg(&softintrslots->state, SINT_IDLE, REG_SEND0);
-        if(state == SINT_IDLE) {
+        qemu_spin_lock(&softintrslots->lock);
+        if(softintrslots->state == SINT_IDLE) {
+            softintrslots->state = REG_SEND0;
             softintrslots->os_id = data;
+            qemu_spin_unlock(&softintrslots->lock);
             return;
-        } else if (state == REG_SEND0) {
+        } else if (softintrslots->state == REG_SEND0) {
             softintrslots->proc_id = data;
-            int i = 0;
             uint64_t os_id = softintrslots->os_id;
             uint64_t proc_id = data;
-            int idx = -1;
-            for(i = 0; i < softintrslots->cap; i++) {
-                if(softintrslots->sendcap[i].recv_os_id == os_id && softintrslots->sendcap[i].recv_proc_id == proc_id) {
-                    qatomic_set(&softintrslots->state, SINT_IDLE);
-                    return;
-                } else if (softintrslots->sendcap[i].recv_os_id == 0 && softintrslots->sendcap[i].recv_proc_id == 0) {
-                    idx = i;
-                }
-            }
-            if(idx != -1) {
-                softintrslots->sendcap[idx].recv_os_id = os_id;
-                softintrslots->sendcap[idx].recv_proc_id = proc_id;
-            } else {
+            softintrslots->state = SINT_IDLE;
+            if(captable_insert(&softintrslots->sendcap, os_id, proc_id) == NULL) {
                 error_report("No send cap slots");
             }
-            qatomic_set(&softintrslots->state, SINT_IDLE);
+            qemu_spin_unlock(&softintrslots->lock);
             return;
         }
+        qemu_spin_unlock(&softintrslots->lock);
     }
 }
 
 void cancel_send(SoftIntrSlots* softintrslots, uint64_t data) {
-    uint64_t state = 0;
     while(1) {
-        state = qatomic_cmpxchg(&softintrslots->state, SINT_IDLE, CANCEL_SEND0);
-        if(state == SINT_IDLE) {
+        qemu_spin_lock(&softintrslots->lock);
+        if(softintrslots->state == SINT_IDLE) {
+            softintrslots->state = CANCEL_SEND0;
             softintrslots->os_id = data;
+            qemu_spin_unlock(&softintrslots->lock);
             return;
-        } else if (state == CANCEL_SEND0) {
+        } else if (softintrslots->state == CANCEL_SEND0) {
             softintrslots->proc_id = data;
-            int i = 0;
             uint64_t os_id = softintrslots->os_id;
             uint64_t proc_id = data;
-            for(i = 0; i < softintrslots->cap; i++) {
-                if(softintrslots->sendcap[i].recv_os_id == os_id && softintrslots->sendcap[i].recv_proc_id == proc_id) {
-                    softintrslots->sendcap[i].recv_os_id = 0;
-                    softintrslots->sendcap[i].recv_proc_id = 0;
-                    qatomic_set(&softintrslots->state, SINT_IDLE);
-                    return;
-                }
-            }
-            // The target send cap is not found.
-            qatomic_set(&softintrslots->state, SINT_IDLE);
+            softintrslots->state = SINT_IDLE;
+            // The target send cap may not be found.
+            captable_remove(&softintrslots->sendcap, os_id, proc_id);
+            qemu_spin_unlock(&softintrslots->lock);
             return;
         }
+        qemu_spin_unlock(&softintrslots->lock);
     }
 }
 
 int64_t check_send(SoftIntrSlots* softintrslots, uint64_t recv_os_id, uint64_t recv_proc_id) {
-    uint64_t state = 0;
-    while(1) {
-        state = qatomic_cmpxchg(&softintrslots->state, SINT_IDLE, CHECK_SEND);
-        if(state == SINT_IDLE) {
-            int64_t sendcap_idx = -1;
-            for(int i = 0; i < softintrslots->cap; i++) {
-                if(softintrslots->sendcap[i].recv_os_id == recv_os_id && softintrslots->sendcap[i].recv_proc_id == recv_proc_id) {
-                    sendcap_idx = i;
-                    break;
-                }
-            }
-            qatomic_set(&softintrslots->state, SINT_IDLE);
-            return sendcap_idx;
-        }
+    int64_t sendcap_idx = -1;
+    qemu_spin_lock(&softintrslots->lock);
+    CapEntry* entry = captable_lookup(&softintrslots->sendcap, recv_os_id, recv_proc_id);
+    if(entry != NULL) {
+        sendcap_idx = entry - softintrslots->sendcap.entries;
     }
+    qemu_spin_unlock(&softintrslots->lock);
+    return sendcap_idx;
 }
 
-void register_recv(SoftIntrSlots* softintrslots, uint64_t data) {
-    uint64_t state = 0;
+// 第三次写入完成注册，返回需要立即唤醒处理任务的次数，一次性的处理任务最多消耗一个待处理中断
+uint64_t register_recv(SoftIntrSlots* softintrslots, uint64_t data) {
     while(1) {
-        state = qatomic_cmpxchg(&softintrslots->state, SINT_IDLE, REG_RECV0);
-        if(state == SINT_IDLE) {
+        qemu_spin_lock(&softintrslots->lock);
+        if(softintrslots->state == SINT_IDLE) {
+            softintrslots->state = REG_RECV0;
             softintrslots->os_id = data;
-            return;
-        } else if (state == REG_RECV0) {
+            qemu_spin_unlock(&softintrslots->lock);
+            return 0;
+        } else if (softintrslots->state == REG_RECV0) {
+            softintrslots->state = REG_RECV1;
             softintrslots->proc_id = data;
-            qatomic_set(&softintrslots->state, REG_RECV1);
-            return;
-        } else if (state == REG_RECV1) {
+            qemu_spin_unlock(&softintrslots->lock);
+            return 0;
+        } else if (softintrslots->state == REG_RECV1) {
             softintrslots->task_id = data;
             uint64_t os_id = softintrslots->os_id;
             uint64_t proc_id = softintrslots->proc_id;
             uint64_t task_id = data;
-            int i = 0;
-            int idx = -1;
-            for(i = 0; i < softintrslots->cap; i++) {
-                if(softintrslots->recvcap[i].send_os_id == os_id && softintrslots->recvcap[i].send_proc_id == proc_id) {
-                    softintrslots->recvcap[i].handler = task_id;
-                    qatomic_set(&softintrslots->state, SINT_IDLE);
-                    return;
-                } else if (softintrslots->recvcap[i].send_os_id == 0 && softintrslots->recvcap[i].send_proc_id == 0) {
-                    idx = i;
+            uint64_t count = 0;
+            softintrslots->state = SINT_IDLE;
+            // 处理任务为 0 时取消注册，之后到达的中断重新记录在 pendcap 中
+            if(task_id == 0) {
+                captable_remove(&softintrslots->recvcap, os_id, proc_id);
+                qemu_spin_unlock(&softintrslots->lock);
+                return 0;
+            }
+            CapEntry* pending = captable_lookup(&softintrslots->pendcap, os_id, proc_id);
+            if(pending != NULL) {
+                if(task_id & TAIC_HANDLER_PERSISTENT) {
+                    count = pending->value;
+                    pending->value = 0;
+                } else {
+                    count = 1;
+                    pending->value--;
                 }
+                if(pending->value == 0) {
+                    captable_remove(&softintrslots->pendcap, os_id, proc_id);
+                }
+            }
+            // 一次性的处理任务已经被待处理的中断消耗
+            if(count != 0 && !(task_id & TAIC_HANDLER_PERSISTENT)) {
+                captable_remove(&softintrslots->recvcap, os_id, proc_id);
+                qemu_spin_unlock(&softintrslots->lock);
+                return count;
             }
-            if(idx != -1) {
-                softintrslots->recvcap[idx].send_os_id = os_id;
-                softintrslots->recvcap[idx].send_proc_id = proc_id;
-                softintrslots->recvcap[idx].handler = task_id;
+            CapEntry* entry = captable_insert(&softintrslots->recvcap, os_id, proc_id);
+            if(entry != NULL) {
+                entry->value = task_id;
             } else {
                 error_report("No recv cap slots");
             }
-            qatomic_set(&softintrslots->state, SINT_IDLE);
-            return;
+            qemu_spin_unlock(&softintrslots->lock);
+            return count;
         }
+        qemu_spin_unlock(&softintrslots->lock);
     }
 }
 
+// 持久的处理任务在唤醒后仍然保持注册，没有处理任务时记录一次待处理的中断
 uint64_t wakeup_soft(SoftIntrSlots* softintrslots, uint64_t send_os_id, uint64_t send_proc_id) {
-    uint64_t state = 0;
-    while(1) {
-        state = qatomic_cmpxchg(&softintrslots->state, SINT_IDLE, WAKEUP);
-        if(state == SINT_IDLE) {
-            int i = 0;
-            for(i = 0; i < softintrslots->cap; i++) {
-                if(softintrslots->recvcap[i].send_os_id == send_os_id && softintrslots->recvcap[i].send_proc_id == send_proc_id) {
-                    uint64_t res = softintrslots->recvcap[i].handler;
-                    softintrslots->recvcap[i].send_os_id = 0;
-                    softintrslots->recvcap[i].send_proc_id = 0;
-                    softintrslots->recvcap[i].handler = 0;
-                    qatomic_set(&softintrslots->state, SINT_IDLE);
-                    return res;
-                }
-            }
-            error_report("Cannot wakeup the softintr task handler");
-            qatomic_set(&softintrslots->state, SINT_IDLE);
-            return 0;
+    qemu_spin_lock(&softintrslots->lock);
+    CapEntry* entry = captable_lookup(&softintrslots->recvcap, send_os_id, send_proc_id);
+    if(entry != NULL) {
+        uint64_t res = entry->value;
+        if(!(res & TAIC_HANDLER_PERSISTENT)) {
+            captable_remove(&softintrslots->recvcap, send_os_id, send_proc_id);
         }
+        qemu_spin_unlock(&softintrslots->lock);
+        return res;
     }
+    CapEntry* pending = captable_insert(&softintrslots->pendcap, send_os_id, send_proc_id);
+    if(pending != NULL) {
+        pending->value++;
+    } else {
+        error_report("Cannot wakeup the softintr task handler");
+    }
+    qemu_spin_unlock(&softintrslots->lock);
+    return 0;
 }
 
 void clean_softintrslots(SoftIntrSlots* softintrslots) {
-    uint64_t state = 0;
-    while(1) {
-        state = qatomic_cmpxchg(&softintrslots->state, SINT_IDLE, CLEAN);
-        if(state == SINT_IDLE) {
-            int i = 0;
-            for(i = 0; i < softintrslots->cap; i++) {
-                softintrslots->sendcap[i].recv_os_id = 0;
-                softintrslots->sendcap[i].recv_proc_id = 0;
-                softintrslots->recvcap[i].send_os_id = 0;
-                softintrslots->recvcap[i].send_proc_id = 0;
-                softintrslots->recvcap[i].handler = 0;
-            }
-            qatomic_set(&softintrslots->state, SINT_IDLE);
-            return;
-        }
-    }
-}
\ No newline at end of file
+    qemu_spin_lock(&softintrslots->lock);
+    captable_clear(&softintrslots->sendcap);
+    captable_clear(&softintrslots->recvcap);
+    captable_clear(&softintrslots->pendcap);
+    softintrslots->state = SINT_IDLE;
+    qemu_spin_unlock(&softintrslots->lock);
+}
@@ -0,0 +1,163 @@
+#include "hw/taic.h"
+#include "qapi/visitor.h"
+#include "qapi/qapi-builtin-visit.h"
+#include "qapi/qapi-types-stats.h"
+#include "sysemu/stats.h"
+
+/*
+ * 统计计数器，同时作为 QOM 属性和 query-stats 的 taic provider 导出。
+ * 每个统计值是一个列表，每个全局队列或局部队列一个元素，局部队列按全局队列的顺序排列；
+ * 唤醒延迟直方图是所有全局队列之和，第 i 个元素统计延迟在 [2^i, 2^(i+1)) ns 之间的任务。
+ */
+enum TaicStatKind {
+    TAIC_STAT_GQ,
+    TAIC_STAT_LQ,
+    TAIC_STAT_HIST,
+};
+
+typedef struct {
+    const char* name;
+    size_t offset;
+    enum TaicStatKind kind;
+    StatsType type;
+} TaicStatDesc;
+
+static const TaicStatDesc taic_stats[] = {
+    { "lq-enqs", offsetof(LocalQueue, enqs), TAIC_STAT_LQ, STATS_TYPE_CUMULATIVE },
+    { "lq-deqs", offsetof(LocalQueue, deqs), TAIC_STAT_LQ, STATS_TYPE_CUMULATIVE },
+    { "lq-empty-deqs", offsetof(LocalQueue, misses), TAIC_STAT_LQ, STATS_TYPE_CUMULATIVE },
+    { "lq-steals", offsetof(LocalQueue, steals), TAIC_STAT_LQ, STATS_TYPE_CUMULATIVE },
+    { "lq-high-water", offsetof(LocalQueue, high_water), TAIC_STAT_LQ, STATS_TYPE_PEAK },
+    { "gq-migrations", offsetof(GlobalQueue, migrations), TAIC_STAT_GQ, STATS_TYPE_CUMULATIVE },
+    { "gq-preemptions", offsetof(GlobalQueue, preemptions), TAIC_STAT_GQ, STATS_TYPE_CUMULATIVE },
+    { "gq-idle-notifies", offsetof(GlobalQueue, idle_notifies), TAIC_STAT_GQ, STATS_TYPE_CUMULATIVE },
+    { "gq-ext-delivered", offsetof(GlobalQueue, ext_delivered), TAIC_STAT_GQ, STATS_TYPE_CUMULATIVE },
+    { "gq-ext-dropped", offsetof(GlobalQueue, ext_dropped), TAIC_STAT_GQ, STATS_TYPE_CUMULATIVE },
+    { "gq-soft-delivered", offsetof(GlobalQueue, soft_delivered), TAIC_STAT_GQ, STATS_TYPE_CUMULATIVE },
+    { "gq-soft-dropped", offsetof(GlobalQueue, soft_dropped), TAIC_STAT_GQ, STATS_TYPE_CUMULATIVE },
+    { "gq-timer-wakeups", offsetof(GlobalQueue, timer_wakeups), TAIC_STAT_GQ, STATS_TYPE_CUMULATIVE },
+    { "gq-timer-dropped", offsetof(GlobalQueue, timer_dropped), TAIC_STAT_GQ, STATS_TYPE_CUMULATIVE },
+    { "wakeup-latency", 0, TAIC_STAT_HIST, STATS_TYPE_LOG2_HISTOGRAM },
+};
+
+// 所有全局队列的唤醒延迟直方图之和，去掉末尾为 0 的桶
+static uint64List* taic_latency_values(TAICState* taic) {
+    uint64_t hist[TAIC_LATENCY_BUCKETS] = { 0 };
+    uint64List* list = NULL;
+    uint64List** tail = &list;
+    int last = 0;
+    if(taic->gqs == NULL || !taic->latency_hist) {
+        return NULL;
+    }
+    for(uint64_t i = 0; i < taic->gq_num; i++) {
+        for(int j = 0; j < TAIC_LATENCY_BUCKETS; j++) {
+            hist[j] += qatomic_read(&taic->gqs[i].latency_hist[j]);
+            if(hist[j] != 0) {
+                last = MAX(last, j);
+            }
+        }
+    }
+    for(int j = 0; j <= last; j++) {
+        QAPI_LIST_APPEND(tail, hist[j]);
+    }
+    return list;
+}
+
+static uint64List* taic_stat_values(TAICState* taic, const TaicStatDesc* desc) {
+    uint64List* list = NULL;
+    uint64List** tail = &list;
+    if(taic->gqs == NULL) {     // not realized yet
+        return NULL;
+    }
+    if(desc->kind == TAIC_STAT_HIST) {
+        return taic_latency_values(taic);
+    }
+    for(uint64_t i = 0; i < taic->gq_num; i++) {
+        GlobalQueue* gq = &(taic->gqs[i]);
+        if(desc->kind == TAIC_STAT_GQ) {
+            QAPI_LIST_APPEND(tail, qatomic_read((uint64_t*)((uint8_t*)gq + desc->offset)));
+            continue;
+        }
+        for(uint64_t j = 0; j < taic->lq_num; j++) {
+            LocalQueue* lq = &(gq->local_queue[j]);
+            QAPI_LIST_APPEND(tail, qatomic_read((uint64_t*)((uint8_t*)lq + desc->offset)));
+        }
+    }
+    return list;
+}
+
+static void taic_get_stat(Object* obj, Visitor* v, const char* name, void* opaque, Error** errp) {
+    uint64List* list = taic_stat_values(TAIC(obj), opaque);
+    visit_type_uint64List(v, name, &list, errp);
+    qapi_free_uint64List(list);
+}
+
+typedef struct {
+    StatsResultList** result;
+    strList* names;
+} TaicStatsArgs;
+
+static int taic_stats_query(Object* obj, void* opaque) {
+    TaicStatsArgs* args = opaque;
+    StatsList* stats_list = NULL;
+    if(!object_dynamic_cast(obj, TYPE_TAIC)) {
+        return 0;
+    }
+    for(int i = 0; i < ARRAY_SIZE(taic_stats); i++) {
+        if(!apply_str_list_filter(taic_stats[i].name, args->names)) {
+            continue;
+        }
+        Stats* stats = g_new0(Stats, 1);
+        stats->name = g_strdup(taic_stats[i].name);
+        stats->value = g_new0(StatsValue, 1);
+        stats->value->type = QTYPE_QLIST;
+        stats->value->u.list = taic_stat_values(TAIC(obj), &taic_stats[i]);
+        QAPI_LIST_PREPEND(stats_list, stats);
+    }
+    if(stats_list != NULL) {
+        StatsResult* entry = g_new0(StatsResult, 1);
+        entry->provider = STATS_PROVIDER_TAIC;
+        entry->qom_path = object_get_canonical_path(obj);
+        entry->stats = stats_list;
+        QAPI_LIST_PREPEND(*args->result, entry);
+    }
+    return 0;
+}
+
+static void taic_stats_cb(StatsResultList** result, StatsTarget target, strList* names,
+                          strList* targets, Error** errp) {
+    if(target != STATS_TARGET_TAIC) {
+        return;
+    }
+    TaicStatsArgs args = {
+        .result = result,
+        .names = names,
+    };
+    object_child_foreach_recursive(object_get_root(), taic_stats_query, &args);
+}
+
+static void taic_schemas_cb(StatsSchemaList** result, Error** errp) {
+    StatsSchemaValueList* stats_list = NULL;
+    for(int i = 0; i < ARRAY_SIZE(taic_stats); i++) {
+        StatsSchemaValue* value = g_new0(StatsSchemaValue, 1);
+        value->name = g_strdup(taic_stats[i].name);
+        value->type = taic_stats[i].type;
+        if(taic_stats[i].kind == TAIC_STAT_HIST) {
+            value->has_unit = true;
+            value->unit = STATS_UNIT_SECONDS;
+            value->has_base = true;
+            value->base = 10;
+            value->exponent = -9;
+        }
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_TAIC, STATS_TARGET_TAIC, stats_list);
+}
+
+void taic_stats_class_init(ObjectClass* oc) {
+    for(int i = 0; i < ARRAY_SIZE(taic_stats); i++) {
+        object_class_property_add(oc, taic_stats[i].name, "uint64List", taic_get_stat,
+                                  NULL, NULL, (void*)&taic_stats[i]);
+    }
+    add_stats_callbacks(STATS_PROVIDER_TAIC, taic_stats_cb, taic_schemas_cb);
+}
@@ -3,6 +3,7 @@
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/host-utils.h"
 #include "qemu/module.h"
 #include "hw/sysbus.h"
 #include "hw/qdev-properties.h"
@@ -10,23 +11,379 @@
 #include "exec/cpu-common.h"
 #include "hw/irq.h"
 #include "target/riscv/cpu.h"
+#include "exec/address-spaces.h"
+#include "qemu/bswap.h"
+#include "trace.h"
+
+// 按照全局队列的通知策略选择接收抢占中断的 hart
+static int64_t taic_pick_hart(TAICState* taic, GlobalQueue* gq) {
+    int64_t hartid = qatomic_read(&gq->hart_id);
+    uint64_t n = taic->hart_count;
+    if(qatomic_read(&gq->notify_policy) != TAIC_NOTIFY_IDLE || n == 0) {
+        return hartid;
+    }
+    // 从上次选中的 hart 之后开始查找，把中断分散到多个空闲的 hart 上
+    uint64_t start = qatomic_read(&gq->notify_cursor);
+    for(uint64_t i = 0; i < n; i++) {
+        uint64_t h = (start + i) % n;
+        if(test_bit(h, gq->hart_mask) && test_bit(h, taic->idle_harts)) {
+            // 选中的 hart 即将被唤醒，不再被其他全局队列当作空闲的 hart
+            clear_bit_atomic(h, taic->idle_harts);
+            qatomic_set(&gq->notify_cursor, h + 1);
+            qatomic_inc(&gq->idle_notifies);
+            return h;
+        }
+    }
+    if(hartid == -1) {
+        uint64_t h = find_first_bit(gq->hart_mask, n);
+        hartid = h < n ? h : -1;
+    }
+    return hartid;
+}
+
+void taic_raise_softirq(TAICState* taic, uint64_t gq_idx) {
+    int64_t hartid = taic_pick_hart(taic, &(taic->gqs[gq_idx]));
+    if(hartid != -1) {
+        qatomic_set(&taic->gqs[gq_idx].notified_hart, hartid);
+        if(taic->gqs[gq_idx].ssip == true) {
+            trace_taic_irq_raise(gq_idx, hartid, "ssip");
+            qemu_irq_raise(taic->ssoft_irqs[hartid]);
+        } else if(taic->gqs[gq_idx].usip == true) {
+            trace_taic_irq_raise(gq_idx, hartid, "usip");
+            qemu_irq_raise(taic->usoft_irqs[hartid]);
+        }
+    }
+}
+
+// 出队时撤销发给该全局队列的软件中断
+void taic_lower_softirq(TAICState* taic, uint64_t gq_idx) {
+    int64_t hartid = qatomic_read(&taic->gqs[gq_idx].notified_hart);
+    if(hartid != -1) {
+        if(taic->gqs[gq_idx].ssip == true) {
+            trace_taic_irq_lower(gq_idx, hartid, "ssip");
+            qemu_irq_lower(taic->ssoft_irqs[hartid]);
+        } else if(taic->gqs[gq_idx].usip == true) {
+            trace_taic_irq_lower(gq_idx, hartid, "usip");
+            qemu_irq_lower(taic->usoft_irqs[hartid]);
+        }
+    }
+}
+
+// 记录发起出队的 hart 是否空闲，只有 vCPU 发起的出队才会被记录
+void taic_note_deq(TAICState* taic, bool empty) {
+    if(current_cpu == NULL) {
+        return;
+    }
+    int64_t hartid = (int64_t)current_cpu->cpu_index - taic->hartid_base;
+    if(hartid < 0 || hartid >= taic->hart_count) {
+        return;
+    }
+    if(empty) {
+        set_bit_atomic(hartid, taic->idle_harts);
+    } else {
+        clear_bit_atomic(hartid, taic->idle_harts);
+    }
+}
+
+/************ The External Interrupt Sources ************/
+
+// 只访问注册了该中断源的全局队列，只在唤醒了抢占任务时发出软件中断；
+// 一次性的处理任务被唤醒后全局队列仍然留在 owners 中，之后的事件计入待处理数
+static void taic_deliver_extintr(TAICState* taic, uint64_t irq_idx) {
+    unsigned long* owners = taic->irqs[irq_idx].owners;
+    trace_taic_deliver_extintr(irq_idx);
+    uint64_t i = find_first_bit(owners, taic->gq_num);
+    while(i < taic->gq_num) {
+        if(handle_extintr(&(taic->gqs[i]), irq_idx)) {
+            taic_raise_softirq(taic, i);
+        }
+        i = find_next_bit(owners, taic->gq_num, i + 1);
+    }
+}
+
+// 一次中断事件，按照中断源的合并设置决定是否立即投递
+static void taic_irq_event(TAICState* taic, uint64_t irq_idx) {
+    TaicIrq* irq = &(taic->irqs[irq_idx]);
+    bool deliver = false;
+    bool arm = false;
+    qemu_spin_lock(&irq->lock);
+    irq->pending++;
+    if(irq->coalesce_count <= 1 || irq->pending >= irq->coalesce_count) {
+        irq->pending = 0;
+        deliver = true;
+    } else if(irq->coalesce_ns != 0 && !irq->armed) {
+        irq->armed = true;
+        arm = true;
+    }
+    qemu_spin_unlock(&irq->lock);
+    // 定时器的操作会加互斥锁，不能放在自旋锁里
+    if(arm) {
+        timer_mod(irq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + irq->coalesce_ns);
+    }
+    if(deliver) {
+        taic_deliver_extintr(taic, irq_idx);
+    }
+}
+
+static void taic_irq_timeout(void* opaque) {
+    TaicIrq* irq = opaque;
+    qemu_spin_lock(&irq->lock);
+    bool deliver = irq->pending != 0;
+    irq->pending = 0;
+    irq->armed = false;
+    qemu_spin_unlock(&irq->lock);
+    if(deliver) {
+        taic_deliver_extintr(irq->taic, irq->idx);
+    }
+}
+
+static void taic_config_irq(TAICState* taic, uint64_t irq_idx, uint64_t value) {
+    TaicIrq* irq = &(taic->irqs[irq_idx]);
+    qemu_spin_lock(&irq->lock);
+    irq->level_trigger = (value & TAIC_IRQ_LEVEL) != 0;
+    irq->coalesce_count = TAIC_IRQ_COALESCE_COUNT(value);
+    irq->coalesce_ns = TAIC_IRQ_COALESCE_US(value) * SCALE_US;
+    qemu_spin_unlock(&irq->lock);
+}
+
+static void taic_irq_init(TAICState* taic) {
+    taic->irqs = g_new0(TaicIrq, taic->intr_num);
+    for(uint32_t i = 0; i < taic->intr_num; i++) {
+        TaicIrq* irq = &(taic->irqs[i]);
+        qemu_spin_init(&irq->lock);
+        irq->taic = taic;
+        irq->idx = i;
+        irq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, taic_irq_timeout, irq);
+        irq->owners = bitmap_new(taic->gq_num);
+    }
+}
+
+void taic_register_ext(TAICState* taic, uint64_t gq_idx, uint64_t irq_idx, uint64_t data) {
+    if(gq_idx >= taic->gq_num) {
+        // error_report("Deq Invalid gq_idx");
+        return;
+    }
+    if(taic->gqs[gq_idx].os_id == 0 && taic->gqs[gq_idx].proc_id == 0) {
+        // error_report("Deq Not used GQ");
+        return;
+    }
+    GlobalQueue* gq = &(taic->gqs[gq_idx]);
+    // 注册时有待处理的事件，立即唤醒处理任务
+    if(register_ext_handler(gq, irq_idx, data)) {
+        taic_raise_softirq(taic, gq_idx);
+    }
+    if(qatomic_read(&gq->extintrslots.registered[irq_idx])) {
+        set_bit_atomic(gq_idx, taic->irqs[irq_idx].owners);
+    } else {
+        clear_bit_atomic(gq_idx, taic->irqs[irq_idx].owners);
+    }
+    // 电平触发的中断线仍然有效时，只唤醒新注册的处理任务，不计入其他全局队列的待处理数
+    TaicIrq* irq = &(taic->irqs[irq_idx]);
+    if(qatomic_read(&irq->level_trigger) && qatomic_read(&irq->level) &&
+       qatomic_read(&gq->extintrslots.slots[irq_idx]) != 0) {
+        if(handle_extintr(gq, irq_idx)) {
+            taic_raise_softirq(taic, gq_idx);
+        }
+    }
+}
+
+// 控制页上模拟的设备中断总是作为一次边沿事件
+void taic_sim_extintr(TAICState* taic, uint64_t irq_idx) {
+    if(irq_idx >= taic->intr_num) {
+        return;
+    }
+    taic_irq_event(taic, irq_idx);
+}
+
+/************ The Sleep Timers ************/
+
+static void taic_timer_expire(void* opaque) {
+    TaicTimer* timer = opaque;
+    TAICState* taic = timer->taic;
+    if(handle_timer(&(taic->gqs[timer->idx]), qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL))) {
+        taic_raise_softirq(taic, timer->idx);
+    }
+    taic_rearm_timer(taic, timer->idx);
+}
+
+// 按照最早的截止时间设置定时器。定时器只会被提前，取消睡眠后多出的一次到期不会唤醒任何任务
+void taic_rearm_timer(TAICState* taic, uint64_t gq_idx) {
+    int64_t deadline;
+    if(sleepq_next(&(taic->gqs[gq_idx].sleepq), &deadline)) {
+        timer_mod_anticipate_ns(taic->timers[gq_idx].timer, deadline);
+    }
+}
+
+static void taic_timer_init(TAICState* taic) {
+    taic->timers = g_new0(TaicTimer, taic->gq_num);
+    for(uint32_t i = 0; i < taic->gq_num; i++) {
+        TaicTimer* timer = &(taic->timers[i]);
+        timer->taic = taic;
+        timer->idx = i;
+        timer->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, taic_timer_expire, timer);
+    }
+}
+
+// 截止时间与 stimecmp 一样以 timebase 的 tick 为单位
+static void taic_set_sleep_deadline(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx, uint64_t ticks) {
+    LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+    if(local_queue == NULL) {
+        return;
+    }
+    uint64_t ns = muldiv64(ticks, NANOSECONDS_PER_SECOND, taic->timebase_freq);
+    qatomic_set(&local_queue->sleep_deadline, MIN(ns, INT64_MAX));
+}
+
+// 任务在 0x878 写入的截止时间到达后进入该局部队列
+static void taic_sleep(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx, uint64_t task) {
+    LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+    if(local_queue == NULL) {
+        return;
+    }
+    if(taic->gqs[gq_idx].os_id == 0 && taic->gqs[gq_idx].proc_id == 0) {
+        return;
+    }
+    int64_t deadline = qatomic_read(&local_queue->sleep_deadline);
+    trace_taic_sleep(gq_idx, lq_idx, deadline, task);
+    if(!register_sleep(&(taic->gqs[gq_idx]), lq_idx, deadline, task)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "taic: the sleep queue of gq %" PRIu64 " is full\n", gq_idx);
+        qatomic_or(&local_queue->error, TAIC_ERR_SLEEP_FULL);
+        return;
+    }
+    // 截止时间已经过去时定时器立即到期
+    timer_mod_anticipate_ns(taic->timers[gq_idx].timer, deadline);
+}
+
+// 批量操作每次在栈上缓存的任务数
+#define TAIC_BATCH_CHUNK    64
+
+// 从客户机内存的批量缓冲区中读取 count 个任务并入队
+static void taic_batch_enq(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx, uint64_t count) {
+    LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+    if(local_queue == NULL) {
+        return;
+    }
+    uint64_t buf[TAIC_BATCH_CHUNK];
+    uint64_t done = 0;
+    count = MIN(count, local_queue->batch_size);
+    trace_taic_batch_enq(gq_idx, lq_idx, count);
+    while(done < count) {
+        uint64_t n = MIN(count - done, TAIC_BATCH_CHUNK);
+        hwaddr addr = local_queue->batch_addr + done * sizeof(uint64_t);
+        if(address_space_read(&address_space_memory, addr, MEMTXATTRS_UNSPECIFIED,
+                              buf, n * sizeof(uint64_t)) != MEMTX_OK) {
+            qemu_log_mask(LOG_GUEST_ERROR, "taic: cannot read batch at 0x%" HWADDR_PRIx "\n", addr);
+            qatomic_or(&local_queue->error, TAIC_ERR_DMA);
+            return;
+        }
+        for(uint64_t i = 0; i < n; i++) {
+            buf[i] = le64_to_cpu(buf[i]);
+        }
+        uint64_t pushed = lq_enq_batch(&(taic->gqs[gq_idx]), lq_idx, buf, n);
+        done += pushed;
+        if(pushed < n) {    // 队列已满，错误已经记录在 read_error 中
+            return;
+        }
+    }
+}
+
+// 最多出队 batch_size 个任务写入客户机内存的批量缓冲区，返回出队的任务数
+static uint64_t taic_batch_deq(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx) {
+    LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+    if(local_queue == NULL) {
+        return 0;
+    }
+    if(taic->gqs[gq_idx].os_id == 0 && taic->gqs[gq_idx].proc_id == 0) {
+        return 0;
+    }
+    taic_lower_softirq(taic, gq_idx);
+    uint64_t buf[TAIC_BATCH_CHUNK];
+    uint64_t done = 0;
+    uint64_t count = local_queue->batch_size;
+    while(done < count) {
+        uint64_t n = MIN(count - done, TAIC_BATCH_CHUNK);
+        uint64_t got = lq_deq_batch(&(taic->gqs[gq_idx]), lq_idx, buf, n);
+        if(got == 0 && done == 0) {
+            got = taic_migrate(taic, gq_idx, buf, n);
+        }
+        if(got == 0) {
+            break;
+        }
+        for(uint64_t i = 0; i < got; i++) {
+            buf[i] = cpu_to_le64(buf[i]);
+        }
+        hwaddr addr = local_queue->batch_addr + done * sizeof(uint64_t);
+        if(address_space_write(&address_space_memory, addr, MEMTXATTRS_UNSPECIFIED,
+                               buf, got * sizeof(uint64_t)) != MEMTX_OK) {
+            qemu_log_mask(LOG_GUEST_ERROR, "taic: cannot write batch at 0x%" HWADDR_PRIx "\n", addr);
+            qatomic_or(&local_queue->error, TAIC_ERR_DMA);
+            // 把没能交给客户机的任务按原来的顺序放回队首
+            while(got > 0) {
+                got--;
+                lq_enq(&(taic->gqs[gq_idx]), lq_idx, le64_to_cpu(buf[got]), 0, true);
+            }
+            return done;
+        }
+        done += got;
+        if(got < n) {
+            break;
+        }
+    }
+    taic_note_deq(taic, done == 0);
+    return done;
+}
+
+// 映射共享环形队列，之后普通任务的入队和出队都不需要经过 MMIO
+static void taic_setup_shm_ring(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx, uint64_t size) {
+    LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+    if(local_queue == NULL) {
+        return;
+    }
+    if(!lq_map_shm_ring(&(taic->gqs[gq_idx]), lq_idx, size)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "taic: cannot map a shared ring of %" PRIu64
+                      " entries at 0x%" PRIx64 "\n", size, local_queue->shm_addr);
+        qatomic_or(&local_queue->error, TAIC_ERR_SHM_RING);
+    }
+}
 
 static uint64_t taic_read(void *opaque, hwaddr addr, unsigned size) {
     TAICState* taic = opaque;
     bool is_ctl = addr < PAGE_SIZE;
     uint64_t op = addr % PAGE_SIZE;
     uint64_t idx = (addr / PAGE_SIZE) - 1;
-    uint64_t gq_idx = idx / LQ_NUM;
-    uint64_t lq_idx = idx % LQ_NUM;
+    uint64_t gq_idx = idx / taic->lq_num;
+    uint64_t lq_idx = idx % taic->lq_num;
     if(is_ctl) {
         if(op == 0x0) {
-            return taic_read_alloc_idx(taic);
+            int64_t res = taic_read_alloc_idx(taic);
+            trace_taic_alloc(res);
+            return res;
         }
     } else {
         if(op == 0x08) { // deq
-            return taic_lq_deq(taic, gq_idx, lq_idx);
+            uint64_t res = taic_lq_deq(taic, gq_idx, lq_idx);
+            trace_taic_deq(gq_idx, lq_idx, res);
+            return res;
         } else if(op == 0x10) { // read_error
-            // TODO
+            return taic_read_error(taic, gq_idx, lq_idx);
+        } else if(op == 0x818) { // batch deq
+            uint64_t res = taic_batch_deq(taic, gq_idx, lq_idx);
+            trace_taic_batch_deq(gq_idx, lq_idx, res);
+            return res;
+        } else if(op == 0x838) { // steal policy
+            return gq_idx < taic->gq_num ? qatomic_read(&taic->gqs[gq_idx].steal_policy) : 0;
+        } else if(op == 0x840) { // steal count
+            LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+            return local_queue != NULL ? qatomic_read(&local_queue->steals) : 0;
+        } else if(op == 0x848) { // miss count
+            LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+            return local_queue != NULL ? qatomic_read(&local_queue->misses) : 0;
+        } else if(op == 0x850) { // load balancing capability
+            return gq_idx < taic->gq_num ? qatomic_read(&taic->gqs[gq_idx].balance_cap) : 0;
+        } else if(op == 0x858) { // migrated task count
+            return gq_idx < taic->gq_num ? qatomic_read(&taic->gqs[gq_idx].migrations) : 0;
+        } else if(op == 0x870) { // notify policy
+            return gq_idx < taic->gq_num ? qatomic_read(&taic->gqs[gq_idx].notify_policy) : 0;
         } else {
             error_report("Invalid MMIO read");
         }
@@ -39,24 +396,30 @@ static void taic_write(void *opaque, hwaddr addr, uint64_t value, unsigned size)
     bool is_ctl = addr < PAGE_SIZE;
     uint64_t op = addr % PAGE_SIZE;
     uint64_t idx = (addr / PAGE_SIZE) - 1;
-    uint64_t gq_idx = idx / LQ_NUM;
-    uint64_t lq_idx = idx % LQ_NUM;
+    uint64_t gq_idx = idx / taic->lq_num;
+    uint64_t lq_idx = idx % taic->lq_num;
     if(is_ctl) {
         if(op == 0x0) {
             // 申请全局队列
             taic_alloc_gq(taic, value);
         } else if(op == 0x8) {
             // 释放局部队列
+            trace_taic_free(value);
             taic_free_gq(taic, value);
-        } else if(op >= 0x10 && op < 0x10 + 0x08 * INTR_NUM) {
+        } else if(op >= 0x10 && op < 0x10 + 0x08 * taic->intr_num) {
             // 模拟产生设备中断
             uint64_t irq_idx = (op - 0x10) / 0x08;
             taic_sim_extintr(taic, irq_idx);
+        } else if(op >= 0x800 && op < 0x800 + 0x08 * taic->intr_num) {
+            // 配置外部中断源的触发方式和中断合并
+            uint64_t irq_idx = (op - 0x800) / 0x08;
+            taic_config_irq(taic, irq_idx, value);
         }
     } else {
         // operations about per queue
         if(op == 0x0) {         // enq
-            taic_lq_enq(taic, gq_idx, lq_idx, value);
+            trace_taic_enq(gq_idx, lq_idx, TAIC_PRIO_DEFAULT, value);
+            taic_lq_enq(taic, gq_idx, lq_idx, TAIC_PRIO_DEFAULT, value);
         } else if(op == 0x18) { // register sender
             taic_register_sender(taic, gq_idx, value);
         } else if(op == 0x20) { // cancel sender
@@ -67,8 +430,52 @@ static void taic_write(void *opaque, hwaddr addr, uint64_t value, unsigned size)
             taic_send_softintr(taic, gq_idx, value);
         } else if(op == 0x38) { // write hartid
             taic_write_hartid(taic, gq_idx, value);
+        } else if(op == 0x800) { // batch buffer address
+            LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+            if(local_queue != NULL) {
+                local_queue->batch_addr = value;
+            }
+        } else if(op == 0x808) { // batch buffer size
+            LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+            if(local_queue != NULL) {
+                local_queue->batch_size = value;
+            }
+        } else if(op == 0x810) { // batch enq
+            taic_batch_enq(taic, gq_idx, lq_idx, value);
+        } else if(op == 0x820) { // shared ring address
+            LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+            if(local_queue != NULL) {
+                local_queue->shm_addr = value;
+            }
+        } else if(op == 0x828) { // shared ring size, 0 to unmap
+            taic_setup_shm_ring(taic, gq_idx, lq_idx, value);
+        } else if(op == 0x830) { // default enq priority
+            LocalQueue* local_queue = taic_local_queue(taic, gq_idx, lq_idx);
+            if(local_queue != NULL && value < taic->prio_num) {
+                qatomic_set(&local_queue->prio, value);
+            }
+        } else if(op == 0x838) { // steal policy
+            taic_set_steal_policy(taic, gq_idx, value);
+        } else if(op == 0x850) { // load balancing capability
+            taic_set_balance_cap(taic, gq_idx, value);
+        } else if(op == 0x860) { // add a hart to the hart mask
+            taic_set_hart(taic, gq_idx, value, true);
+        } else if(op == 0x868) { // remove a hart from the hart mask
+            taic_set_hart(taic, gq_idx, value, false);
+        } else if(op == 0x870) { // notify policy
+            taic_set_notify_policy(taic, gq_idx, value);
+        } else if(op == 0x878) { // sleep deadline
+            taic_set_sleep_deadline(taic, gq_idx, lq_idx, value);
+        } else if(op == 0x880) { // sleep until the deadline
+            taic_sleep(taic, gq_idx, lq_idx, value);
+        } else if(op == 0x888) { // cancel sleep
+            taic_cancel_sleep(taic, gq_idx, value);
+        } else if(op >= 0x900 && op < 0x900 + 0x08 * taic->prio_num) { // enq with priority
+            uint64_t prio = (op - 0x900) / 0x08;
+            trace_taic_enq(gq_idx, lq_idx, prio, value);
+            taic_lq_enq(taic, gq_idx, lq_idx, prio, value);
         } else {                // register external intr
-            if(op >= 0x40 && op < 0x40 + 0x08 * INTR_NUM) {
+            if(op >= 0x40 && op < 0x40 + 0x08 * taic->intr_num) {
                 uint64_t irq_idx = (op - 0x40) / 0x08;
                 taic_register_ext(taic, gq_idx, irq_idx, value);
             } else {
@@ -78,9 +485,62 @@ static void taic_write(void *opaque, hwaddr addr, uint64_t value, unsigned size)
     }
 }
 
+/************ The MSI Doorbell ************/
+
+// 消息中断直接投递到门铃页对应的全局队列，不经过外部中断源的合并和 owners
+static void taic_msi_write(void *opaque, hwaddr addr, uint64_t value, unsigned size) {
+    TAICState* taic = opaque;
+    uint64_t gq_idx = addr / PAGE_SIZE;
+    if((addr % PAGE_SIZE) != TAIC_MSI_SETEIPNUM) {
+        qemu_log_mask(LOG_GUEST_ERROR, "taic: invalid MSI write at 0x%" HWADDR_PRIx "\n", addr);
+        return;
+    }
+    // 与 IMSIC 一样，超出范围的中断号被忽略，空闲的全局队列也不记录待处理的事件
+    if(gq_idx >= taic->gq_num || value >= taic->intr_num) {
+        return;
+    }
+    if(qatomic_read(&taic->gqs[gq_idx].os_id) == 0 && qatomic_read(&taic->gqs[gq_idx].proc_id) == 0) {
+        return;
+    }
+    trace_taic_msi(gq_idx, value);
+    if(handle_extintr(&(taic->gqs[gq_idx]), value)) {
+        taic_raise_softirq(taic, gq_idx);
+    }
+}
+
+static uint64_t taic_msi_read(void *opaque, hwaddr addr, unsigned size) {
+    return 0;
+}
+
+static const MemoryRegionOps taic_msi_ops = {
+    .read = taic_msi_read,
+    .write = taic_msi_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    // PCIe 设备的 MSI 写是 4 字节
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 8
+    },
+    .impl = {
+        .min_access_size = 4,
+        .max_access_size = 8
+    }
+};
+
+// 外部中断线只在上升沿产生中断事件，下降沿只更新电平
 static void taic_irq_request(void *opaque, int irq, int level) {
     TAICState* taic = opaque;
-    taic_sim_extintr(taic, irq);
+    if(irq >= taic->intr_num) {
+        return;
+    }
+    TaicIrq* source = &(taic->irqs[irq]);
+    qemu_spin_lock(&source->lock);
+    bool rising = level && !source->level;
+    qatomic_set(&source->level, level != 0);
+    qemu_spin_unlock(&source->lock);
+    if(rising) {
+        taic_irq_event(taic, irq);
+    }
 }
 
 static const MemoryRegionOps taic_ops = {
@@ -97,15 +557,92 @@ static const MemoryRegionOps taic_ops = {
     }
 };
 
+// 复位后所有全局队列都被释放，统计计数器保持不变
+static void taic_reset_hold(Object *obj, ResetType type) {
+    TAICState* taic = TAIC(obj);
+    qemu_spin_lock(&taic->ctrl_lock);
+    taic->state = IDLE;
+    taic->os_id = 0;
+    taic->proc_id = 0;
+    taic->send_os_id = 0;
+    taic->send_proc_id = 0;
+    taic->alloc_idx = 0;
+    seqlock_write_begin(&taic->gq_seq);
+    captable_clear(&taic->gq_index);
+    bitmap_zero(taic->gq_used, taic->gq_num);
+    for(uint32_t i = 0; i < taic->gq_num; i++) {
+        reset_global_queue(&(taic->gqs[i]));
+    }
+    seqlock_write_end(&taic->gq_seq);
+    qemu_spin_unlock(&taic->ctrl_lock);
+    if(taic->hart_count > 0) {
+        bitmap_zero(taic->idle_harts, taic->hart_count);
+    }
+    for(uint32_t i = 0; i < taic->gq_num; i++) {
+        timer_del(taic->timers[i].timer);
+    }
+    // 输入线的电平由设备驱动，复位时保持不变
+    for(uint32_t i = 0; i < taic->intr_num; i++) {
+        TaicIrq* irq = &(taic->irqs[i]);
+        timer_del(irq->timer);
+        qemu_spin_lock(&irq->lock);
+        irq->level_trigger = false;
+        irq->coalesce_count = 0;
+        irq->coalesce_ns = 0;
+        irq->pending = 0;
+        irq->armed = false;
+        qemu_spin_unlock(&irq->lock);
+        bitmap_zero(irq->owners, taic->gq_num);
+    }
+}
+
 static void taic_realize(DeviceState *dev, Error **errp)
 {
     TAICState *taic = TAIC(dev);
+    if(taic->gq_num == 0 || taic->lq_num == 0) {
+        error_setg(errp, "gq_num and lq_num must be non-zero");
+        return;
+    }
+    // 每个局部队列占用一个页，第 0 页是控制页
+    if(((uint64_t)taic->gq_num * taic->lq_num + 1) * PAGE_SIZE > TAIC_MMIO_SIZE) {
+        error_setg(errp, "%u global queues with %u local queues each do not fit "
+                   "in the MMIO window", taic->gq_num, taic->lq_num);
+        return;
+    }
+    if(taic->intr_num > TAIC_MAX_INTR_NUM) {
+        error_setg(errp, "intr_num must not exceed %u", TAIC_MAX_INTR_NUM);
+        return;
+    }
+    if(!is_power_of_2(taic->lq_capacity)) {
+        error_setg(errp, "lq_capacity must be a power of 2, got %u", taic->lq_capacity);
+        return;
+    }
+    if(taic->prio_num == 0 || taic->prio_num > TAIC_MAX_PRIO_NUM) {
+        error_setg(errp, "prio_num must be between 1 and %u", TAIC_MAX_PRIO_NUM);
+        return;
+    }
+    if(!taic_steal_policy_valid(taic->steal_policy)) {
+        error_setg(errp, "Invalid steal_policy 0x%x", taic->steal_policy);
+        return;
+    }
+    if(taic->sleep_capacity == 0 || taic->timebase_freq == 0) {
+        error_setg(errp, "sleep_capacity and timebase_freq must be non-zero");
+        return;
+    }
     info_report(" taic realize");
     memory_region_init_io(&taic->mmio, OBJECT(dev), &taic_ops, taic,
                           TYPE_TAIC, TAIC_MMIO_SIZE);
+    // 队列操作由 TAIC 内部的细粒度锁保护，不需要 BQL
+    memory_region_enable_lockless_io(&taic->mmio);
     sysbus_init_mmio(SYS_BUS_DEVICE(dev), &taic->mmio);
+    memory_region_init_io(&taic->msi, OBJECT(dev), &taic_msi_ops, taic,
+                          TYPE_TAIC "-msi", (uint64_t)taic->gq_num * PAGE_SIZE);
+    memory_region_enable_lockless_io(&taic->msi);
+    sysbus_init_mmio(SYS_BUS_DEVICE(dev), &taic->msi);
     info_report("low 0x%x high 0x%x", (uint32_t)taic->mmio.addr, (uint32_t)taic->mmio.size);
     taic_init(taic);
+    taic_irq_init(taic);
+    taic_timer_init(taic);
     // init external_irqs
     uint32_t external_irq_count = taic->external_irq_count;
     taic->external_irqs = g_malloc(sizeof(qemu_irq) * external_irq_count);
@@ -119,7 +656,7 @@ static void taic_realize(DeviceState *dev, Error **errp)
     qdev_init_gpio_out(dev, taic->usoft_irqs, hart_count);
     int i = 0;
     for(i = 0; i < hart_count; i++) {
-        RISCVCPU *cpu = RISCV_CPU(qemu_get_cpu(i));
+        RISCVCPU *cpu = RISCV_CPU(qemu_get_cpu(taic->hartid_base + i));
         /* Claim software interrupt bits */
         if (riscv_cpu_claim_interrupts(cpu, MIP_USIP) < 0) {
             error_report("USIP already claimed");
@@ -134,14 +671,28 @@ static void taic_realize(DeviceState *dev, Error **errp)
 
 static Property taic_properties[] = {
     DEFINE_PROP_UINT32("hart_count", TAICState, hart_count, 0),
+    DEFINE_PROP_UINT32("hartid_base", TAICState, hartid_base, 0),
     DEFINE_PROP_UINT32("external_irq_count", TAICState, external_irq_count, 0),
+    DEFINE_PROP_UINT32("gq_num", TAICState, gq_num, GQ_NUM),
+    DEFINE_PROP_UINT32("lq_num", TAICState, lq_num, LQ_NUM),
+    DEFINE_PROP_UINT32("intr_num", TAICState, intr_num, INTR_NUM),
+    DEFINE_PROP_UINT32("lq_capacity", TAICState, lq_capacity, TAIC_LQ_CAPACITY),
+    DEFINE_PROP_UINT32("prio_num", TAICState, prio_num, TAIC_PRIO_NUM),
+    DEFINE_PROP_UINT32("steal_policy", TAICState, steal_policy, TAIC_STEAL_FIRST),
+    DEFINE_PROP_UINT32("sleep_capacity", TAICState, sleep_capacity, TAIC_SLEEP_CAPACITY),
+    DEFINE_PROP_UINT32("timebase_freq", TAICState, timebase_freq, TAIC_TIMEBASE_FREQ),
+    DEFINE_PROP_BOOL("latency_hist", TAICState, latency_hist, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
 static void taic_class_init(ObjectClass *obj, void *data) {
     DeviceClass *dc = DEVICE_CLASS(obj);
+    ResettableClass *rc = RESETTABLE_CLASS(obj);
     device_class_set_props(dc, taic_properties);
     dc->realize = taic_realize;
+    dc->vmsd = &vmstate_taic;
+    rc->phases.hold = taic_reset_hold;
+    taic_stats_class_init(obj);
 }
 
 static const TypeInfo taic_info = {
@@ -157,16 +708,23 @@ static void taic_register_types(void) {
 
 type_init(taic_register_types)
 
-DeviceState *taic_create(hwaddr addr, uint32_t hart_count, uint32_t external_irq_count) {
+DeviceState *taic_create(hwaddr addr, hwaddr msi_addr, uint32_t hartid_base,
+                         uint32_t hart_count, uint32_t external_irq_count, uint32_t gq_num, uint32_t lq_num,
+                         uint32_t intr_num) {
     qemu_log("create taic\n");
     DeviceState *dev = qdev_new(TYPE_TAIC);
+    qdev_prop_set_uint32(dev, "hartid_base", hartid_base);
     qdev_prop_set_uint32(dev, "hart_count", hart_count);
     qdev_prop_set_uint32(dev, "external_irq_count", external_irq_count);
+    qdev_prop_set_uint32(dev, "gq_num", gq_num);
+    qdev_prop_set_uint32(dev, "lq_num", lq_num);
+    qdev_prop_set_uint32(dev, "intr_num", intr_num);
     sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
     sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, addr);
+    sysbus_mmio_map(SYS_BUS_DEVICE(dev), 1, msi_addr);
     int i = 0;
     for (i = 0; i < hart_count; i++) {
-        CPUState *cpu = qemu_get_cpu(i);
+        CPUState *cpu = qemu_get_cpu(hartid_base + i);
         qdev_connect_gpio_out(dev, i, qdev_get_gpio_in(DEVICE(cpu), IRQ_S_SOFT));
         qdev_connect_gpio_out(dev, i + hart_count, qdev_get_gpio_in(DEVICE(cpu), IRQ_U_SOFT));
     }
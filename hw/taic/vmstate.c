@@ -0,0 +1,429 @@
+#include "hw/taic.h"
+#include "migration/vmstate.h"
+#include "migration/qemu-file-types.h"
+#include "qemu/timer.h"
+
+/*
+ * TAIC 的迁移状态。队列的内容、中断槽和能力表都被迁移；
+ * 可以从其他状态推导出的内容（全局队列索引、非空位图和共享环形队列位图、中断源的 owners、
+ * 局部队列的计数）在 post_load 中重建，共享环形队列在 post_load 中重新映射。
+ * 空闲 hart 只是选择通知目标的提示，不迁移；唤醒延迟直方图也不迁移。
+ * 睡眠定时器在 post_load 中按照睡眠队列重新设置。
+ */
+
+// 只迁移有效的任务：长度，然后是每个任务及其入队时间戳
+static int put_taic_queue(QEMUFile* f, void* pv, size_t size, const VMStateField* field,
+                          JSONWriter* vmdesc) {
+    Queue* queue = pv;
+    uint32_t len = queue_len(queue);
+    qemu_put_be32(f, len);
+    for(uint32_t i = 0; i < len; i++) {
+        uint32_t pos = (queue->head + i) & queue->mask;
+        qemu_put_be64(f, queue->buf[pos]);
+        qemu_put_sbe64(f, queue->stamp != NULL ? queue->stamp[pos] : 0);
+    }
+    return 0;
+}
+
+static int get_taic_queue(QEMUFile* f, void* pv, size_t size, const VMStateField* field) {
+    Queue* queue = pv;
+    uint32_t len = qemu_get_be32(f);
+    if(len > (uint64_t)queue->mask + 1) {
+        error_report("taic: migrated queue of %u tasks exceeds the capacity %" PRIu64,
+                     len, (uint64_t)queue->mask + 1);
+        return -EINVAL;
+    }
+    queue_clear(queue);
+    for(uint32_t i = 0; i < len; i++) {
+        uint64_t data = qemu_get_be64(f);
+        int64_t stamp = qemu_get_sbe64(f);
+        queue_push(queue, data, stamp);
+    }
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_taic_queue = {
+    .name = "taic_queue",
+    .get = get_taic_queue,
+    .put = put_taic_queue,
+};
+
+// 能力表按表项迁移，加载时重新插入，不依赖两端的哈希表布局
+static int put_taic_captable(QEMUFile* f, void* pv, size_t size, const VMStateField* field,
+                             JSONWriter* vmdesc) {
+    CapTable* table = pv;
+    qemu_put_be64(f, table->count);
+    for(uint64_t i = 0; i <= table->mask; i++) {
+        CapEntry* entry = &table->entries[i];
+        if(entry->os_id == 0 && entry->proc_id == 0) {
+            continue;
+        }
+        qemu_put_be64(f, entry->os_id);
+        qemu_put_be64(f, entry->proc_id);
+        qemu_put_be64(f, entry->value);
+    }
+    return 0;
+}
+
+static int get_taic_captable(QEMUFile* f, void* pv, size_t size, const VMStateField* field) {
+    CapTable* table = pv;
+    uint64_t count = qemu_get_be64(f);
+    if(count > table->cap) {
+        error_report("taic: migrated capability table of %" PRIu64 " entries exceeds "
+                     "the capacity %" PRIu64, count, table->cap);
+        return -EINVAL;
+    }
+    captable_clear(table);
+    for(uint64_t i = 0; i < count; i++) {
+        uint64_t os_id = qemu_get_be64(f);
+        uint64_t proc_id = qemu_get_be64(f);
+        uint64_t value = qemu_get_be64(f);
+        CapEntry* entry = captable_insert(table, os_id, proc_id);
+        if(entry == NULL) {
+            return -EINVAL;
+        }
+        entry->value = value;
+    }
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_taic_captable = {
+    .name = "taic_captable",
+    .get = get_taic_captable,
+    .put = put_taic_captable,
+};
+
+// 睡眠队列按堆的顺序迁移，加载时逐个重新插入
+static int put_taic_sleepq(QEMUFile* f, void* pv, size_t size, const VMStateField* field,
+                           JSONWriter* vmdesc) {
+    SleepQueue* sleepq = pv;
+    qemu_put_be32(f, sleepq->count);
+    for(uint32_t i = 0; i < sleepq->count; i++) {
+        qemu_put_sbe64(f, sleepq->heap[i].deadline);
+        qemu_put_be64(f, sleepq->heap[i].task);
+        qemu_put_be32(f, sleepq->heap[i].lq_idx);
+    }
+    return 0;
+}
+
+// 睡眠队列只出现在全局队列中，唤醒的局部队列必须属于该全局队列
+static int get_taic_sleepq(QEMUFile* f, void* pv, size_t size, const VMStateField* field) {
+    SleepQueue* sleepq = pv;
+    GlobalQueue* gq = container_of(sleepq, GlobalQueue, sleepq);
+    uint32_t count = qemu_get_be32(f);
+    if(count > sleepq->cap) {
+        error_report("taic: migrated sleep queue of %u tasks exceeds the capacity %u",
+                     count, sleepq->cap);
+        return -EINVAL;
+    }
+    sleepq_clear(sleepq);
+    for(uint32_t i = 0; i < count; i++) {
+        int64_t deadline = qemu_get_sbe64(f);
+        uint64_t task = qemu_get_be64(f);
+        uint32_t lq_idx = qemu_get_be32(f);
+        if(lq_idx >= gq->lq_num) {
+            error_report("taic: migrated sleeping task wakes up the local queue %u of %u",
+                         lq_idx, gq->lq_num);
+            return -EINVAL;
+        }
+        sleepq_push(sleepq, deadline, task, lq_idx);
+    }
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_taic_sleepq = {
+    .name = "taic_sleepq",
+    .get = get_taic_sleepq,
+    .put = put_taic_sleepq,
+};
+
+static bool taic_lq_sleep_needed(void* opaque) {
+    LocalQueue* local_queue = opaque;
+    return local_queue->sleep_deadline != 0;
+}
+
+static const VMStateDescription vmstate_taic_lq_sleep = {
+    .name = "taic/local_queue/sleep",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = taic_lq_sleep_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_INT64(sleep_deadline, LocalQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_taic_lq = {
+    .name = "taic/local_queue",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BOOL(is_used, LocalQueue),
+        VMSTATE_VARRAY_UINT32(ready_queue, LocalQueue, prio_num, 0,
+                              vmstate_info_taic_queue, Queue),
+        VMSTATE_UINT64(prio, LocalQueue),
+        VMSTATE_UINT64(error, LocalQueue),
+        VMSTATE_UINT64(enqs, LocalQueue),
+        VMSTATE_UINT64(deqs, LocalQueue),
+        VMSTATE_UINT64(steals, LocalQueue),
+        VMSTATE_UINT64(misses, LocalQueue),
+        VMSTATE_UINT64(high_water, LocalQueue),
+        VMSTATE_UINT64(batch_addr, LocalQueue),
+        VMSTATE_UINT64(batch_size, LocalQueue),
+        VMSTATE_UINT64(shm_addr, LocalQueue),
+        VMSTATE_UINT64(shm_size, LocalQueue),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_taic_lq_sleep,
+        NULL
+    }
+};
+
+static bool taic_ext_pending_needed(void* opaque) {
+    ExtIntrSlots* extintrslots = opaque;
+    for(uint32_t i = 0; i < extintrslots->cap; i++) {
+        if(extintrslots->pending[i] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const VMStateDescription vmstate_taic_extintrslots_pending = {
+    .name = "taic/extintrslots/pending",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = taic_ext_pending_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_VARRAY_UINT32(pending, ExtIntrSlots, cap, 0, vmstate_info_uint32, uint32_t),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+// 一次性的处理任务被唤醒后仍然是注册的，这时 slots 中已经没有处理任务，需要单独迁移
+static bool taic_ext_registered_needed(void* opaque) {
+    ExtIntrSlots* extintrslots = opaque;
+    for(uint32_t i = 0; i < extintrslots->cap; i++) {
+        if(extintrslots->registered[i] && extintrslots->slots[i] == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const VMStateDescription vmstate_taic_extintrslots_registered = {
+    .name = "taic/extintrslots/registered",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = taic_ext_registered_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_VARRAY_UINT32(registered, ExtIntrSlots, cap, 0, vmstate_info_bool, bool),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int taic_extintrslots_pre_load(void* opaque) {
+    ExtIntrSlots* extintrslots = opaque;
+    memset(extintrslots->registered, 0, extintrslots->cap * sizeof(bool));
+    return 0;
+}
+
+// 有处理任务的中断源一定是注册的
+static int taic_extintrslots_post_load(void* opaque, int version_id) {
+    ExtIntrSlots* extintrslots = opaque;
+    for(uint32_t i = 0; i < extintrslots->cap; i++) {
+        extintrslots->registered[i] |= extintrslots->slots[i] != 0;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_taic_extintrslots = {
+    .name = "taic/extintrslots",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_load = taic_extintrslots_pre_load,
+    .post_load = taic_extintrslots_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_VARRAY_UINT32(slots, ExtIntrSlots, cap, 0, vmstate_info_uint64, uint64_t),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_taic_extintrslots_pending,
+        &vmstate_taic_extintrslots_registered,
+        NULL
+    }
+};
+
+static bool taic_soft_pending_needed(void* opaque) {
+    SoftIntrSlots* softintrslots = opaque;
+    return softintrslots->pendcap.count != 0;
+}
+
+static const VMStateDescription vmstate_taic_softintrslots_pending = {
+    .name = "taic/softintrslots/pending",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = taic_soft_pending_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_SINGLE(pendcap, SoftIntrSlots, 0, vmstate_info_taic_captable, CapTable),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_taic_softintrslots = {
+    .name = "taic/softintrslots",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT64(state, SoftIntrSlots),
+        VMSTATE_UINT64(os_id, SoftIntrSlots),
+        VMSTATE_UINT64(proc_id, SoftIntrSlots),
+        VMSTATE_UINT64(task_id, SoftIntrSlots),
+        VMSTATE_SINGLE(sendcap, SoftIntrSlots, 0, vmstate_info_taic_captable, CapTable),
+        VMSTATE_SINGLE(recvcap, SoftIntrSlots, 0, vmstate_info_taic_captable, CapTable),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_taic_softintrslots_pending,
+        NULL
+    }
+};
+
+static bool taic_gq_sleep_needed(void* opaque) {
+    GlobalQueue* gq = opaque;
+    return gq->sleepq.count != 0 || gq->timer_wakeups != 0 || gq->timer_dropped != 0;
+}
+
+static const VMStateDescription vmstate_taic_gq_sleep = {
+    .name = "taic/global_queue/sleep",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = taic_gq_sleep_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_SINGLE(sleepq, GlobalQueue, 0, vmstate_info_taic_sleepq, SleepQueue),
+        VMSTATE_UINT64(timer_wakeups, GlobalQueue),
+        VMSTATE_UINT64(timer_dropped, GlobalQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_taic_gq = {
+    .name = "taic/global_queue",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT64(sint_state, GlobalQueue),
+        VMSTATE_UINT64(os_id, GlobalQueue),
+        VMSTATE_UINT64(proc_id, GlobalQueue),
+        VMSTATE_INT64(hart_id, GlobalQueue),
+        VMSTATE_INT64(notified_hart, GlobalQueue),
+        VMSTATE_BITMAP(hart_mask, GlobalQueue, 0, hart_count),
+        VMSTATE_UINT64(notify_policy, GlobalQueue),
+        VMSTATE_UINT64(notify_cursor, GlobalQueue),
+        VMSTATE_BOOL(ssip, GlobalQueue),
+        VMSTATE_BOOL(usip, GlobalQueue),
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(local_queue, GlobalQueue, lq_num,
+                                             vmstate_taic_lq, LocalQueue),
+        VMSTATE_STRUCT(extintrslots, GlobalQueue, 0, vmstate_taic_extintrslots, ExtIntrSlots),
+        VMSTATE_STRUCT(softintrslots, GlobalQueue, 0, vmstate_taic_softintrslots, SoftIntrSlots),
+        VMSTATE_UINT64(steal_policy, GlobalQueue),
+        VMSTATE_UINT64(steal_cursor, GlobalQueue),
+        VMSTATE_UINT64(steal_seed, GlobalQueue),
+        VMSTATE_UINT64(balance_cap, GlobalQueue),
+        VMSTATE_UINT64(migrations, GlobalQueue),
+        VMSTATE_UINT64(preemptions, GlobalQueue),
+        VMSTATE_UINT64(idle_notifies, GlobalQueue),
+        VMSTATE_UINT64(ext_delivered, GlobalQueue),
+        VMSTATE_UINT64(ext_dropped, GlobalQueue),
+        VMSTATE_UINT64(soft_delivered, GlobalQueue),
+        VMSTATE_UINT64(soft_dropped, GlobalQueue),
+        VMSTATE_UINT64(used_lq_count, GlobalQueue),
+        VMSTATE_UINT64(recv_os, GlobalQueue),
+        VMSTATE_UINT64(recv_proc, GlobalQueue),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_taic_gq_sleep,
+        NULL
+    }
+};
+
+static const VMStateDescription vmstate_taic_irq = {
+    .name = "taic/irq",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BOOL(level_trigger, TaicIrq),
+        VMSTATE_BOOL(level, TaicIrq),
+        VMSTATE_UINT32(coalesce_count, TaicIrq),
+        VMSTATE_UINT64(coalesce_ns, TaicIrq),
+        VMSTATE_UINT32(pending, TaicIrq),
+        VMSTATE_BOOL(armed, TaicIrq),
+        VMSTATE_TIMER_PTR(timer, TaicIrq),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int taic_post_load(void* opaque, int version_id) {
+    TAICState* taic = opaque;
+    captable_clear(&taic->gq_index);
+    bitmap_zero(taic->gq_used, taic->gq_num);
+    for(uint32_t i = 0; i < taic->gq_num; i++) {
+        GlobalQueue* gq = &(taic->gqs[i]);
+        gq_post_load(gq);
+        if(gq->os_id == 0 && gq->proc_id == 0) {
+            continue;
+        }
+        CapEntry* entry = captable_insert(&taic->gq_index, gq->os_id, gq->proc_id);
+        if(entry == NULL) {
+            return -EINVAL;
+        }
+        entry->value = i;
+        set_bit(i, taic->gq_used);
+    }
+    // 注册了中断源的全局队列就是它的 owners
+    for(uint32_t j = 0; j < taic->intr_num; j++) {
+        bitmap_zero(taic->irqs[j].owners, taic->gq_num);
+        for(uint32_t i = 0; i < taic->gq_num; i++) {
+            if(taic->gqs[i].extintrslots.registered[j]) {
+                set_bit(i, taic->irqs[j].owners);
+            }
+        }
+    }
+    if(taic->hart_count > 0) {
+        bitmap_zero(taic->idle_harts, taic->hart_count);
+    }
+    // 虚拟时钟随迁移保持连续，按照迁移过来的截止时间重新设置定时器
+    for(uint32_t i = 0; i < taic->gq_num; i++) {
+        timer_del(taic->timers[i].timer);
+        taic_rearm_timer(taic, i);
+    }
+    return 0;
+}
+
+const VMStateDescription vmstate_taic = {
+    .name = "taic",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = taic_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_EQUAL(hart_count, TAICState, NULL),
+        VMSTATE_UINT32_EQUAL(gq_num, TAICState, NULL),
+        VMSTATE_UINT32_EQUAL(lq_num, TAICState, NULL),
+        VMSTATE_UINT32_EQUAL(intr_num, TAICState, NULL),
+        VMSTATE_UINT32_EQUAL(lq_capacity, TAICState, NULL),
+        VMSTATE_UINT32_EQUAL(prio_num, TAICState, NULL),
+        VMSTATE_UINT64(state, TAICState),
+        VMSTATE_UINT64(os_id, TAICState),
+        VMSTATE_UINT64(proc_id, TAICState),
+        VMSTATE_UINT64(send_os_id, TAICState),
+        VMSTATE_UINT64(send_proc_id, TAICState),
+        VMSTATE_INT64(alloc_idx, TAICState),
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(gqs, TAICState, gq_num,
+                                             vmstate_taic_gq, GlobalQueue),
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(irqs, TAICState, intr_num,
+                                             vmstate_taic_irq, TaicIrq),
+        VMSTATE_END_OF_LIST()
+    }
+};
@@ -799,6 +799,9 @@ struct MemoryRegion {
 
     /* For devices designed to perform re-entrant IO into their own IO MRs */
     bool disable_reentrancy_guard;
+
+    /* Accesses are dispatched without taking the BQL */
+    bool lockless_io;
 };
 
 struct IOMMUMemoryRegion {
@@ -2244,6 +2247,20 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_enable_lockless_io: Allow accesses without the BQL.
+ *
+ * By default the memory core takes the Big QEMU Lock around every access
+ * to an I/O region.  Devices that do their own fine-grained locking can
+ * opt out so that accesses from different vCPUs run concurrently.  The
+ * device's callbacks must then take the BQL themselves for anything that
+ * still relies on it.  This also disables the per-device re-entrancy
+ * guard, which would otherwise reject concurrent accesses.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_enable_lockless_io(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -198,8 +198,12 @@ struct CPUClass {
  */
 #define NB_MMU_MODES 16
 
-/* Use a fully associative victim tlb of 8 entries. */
-#define CPU_VTLB_SIZE 8
+/*
+ * Use a fully associative victim tlb, by default of 8 entries.
+ * The size can be changed with "-accel tcg,vtlb-size=N".
+ */
+#define CPU_VTLB_DEFAULT_SIZE 8
+#define CPU_VTLB_MAX_SIZE 256
 
 /*
  * The full TLB entry, which is not accessed by generated TCG code,
@@ -284,9 +288,11 @@ typedef struct CPUTLBDesc {
     size_t n_used_entries;
     /* The next index to use in the tlb victim table.  */
     size_t vindex;
+    /* The number of entries in the tlb victim table.  */
+    size_t vtlb_size;
     /* The tlb victim table, in two parts.  */
-    CPUTLBEntry vtable[CPU_VTLB_SIZE];
-    CPUTLBEntryFull vfulltlb[CPU_VTLB_SIZE];
+    CPUTLBEntry *vtable;
+    CPUTLBEntryFull *vfulltlb;
     CPUTLBEntryFull *fulltlb;
 } CPUTLBDesc;
 
@@ -310,6 +316,14 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    /*
+     * Lookups that missed the main tlb and had to take the slow path,
+     * how many of those were found in the victim tlb, and how many
+     * times the target was asked to fill the tlb.
+     */
+    size_t miss_count;
+    size_t victim_hit_count;
+    size_t fill_count;
 } CPUTLBCommon;
 
 /*
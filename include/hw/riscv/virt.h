@@ -58,6 +58,11 @@ struct RISCVVirtState {
     bool have_aclint;
     RISCVVirtAIAType aia_type;
     int aia_guests;
+    uint32_t taic_gq_num;
+    uint32_t taic_lq_num;
+    uint32_t taic_intr_num;
+    bool taic_intr_num_set;
+    bool taic_irq;
     char *oem_id;
     char *oem_table_id;
     OnOffAuto acpi;
@@ -71,6 +76,8 @@ enum {
     VIRT_TEST,
     VIRT_RTC,
     VIRT_TAIC,
+    VIRT_TAIC_REMOTE,
+    VIRT_TAIC_MSI,
     VIRT_CLINT,
     VIRT_ACLINT_SSWI,
     VIRT_PLIC,
@@ -9,6 +9,9 @@
 #include "hw/sysbus.h"
 #include "qom/object.h"
 #include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/seqlock.h"
+#include "qemu/bitmap.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "hw/irq.h"
@@ -17,143 +20,424 @@
 #define TAIC_MMIO_BASE      0x1000000
 #define TAIC_MMIO_SIZE      0x1000000
 #define PAGE_SIZE           0x1000
+/* The default queue geometry, see the gq_num/lq_num/intr_num properties */
 #define GQ_NUM              4
 #define LQ_NUM              8
 #define INTR_NUM            6
+/* The external interrupt registers of a queue page must stay below 0x800 */
+#define TAIC_MAX_INTR_NUM   ((0x800 - 0x40) / 0x08)
 
-typedef QSIMPLEQ_HEAD(, QueueEntry) QueueHead;
+#define TAIC_LQ_CAPACITY    1024
 
-struct QueueEntry {
-    uint64_t data;
-    QSIMPLEQ_ENTRY(QueueEntry) next;
-};
+/*
+ * The MSI doorbell window, one page per global queue. Like the seteipnum_le
+ * register of an IMSIC interrupt file, writing an identity to offset 0 of the
+ * page of a global queue wakes the handler registered in that slot of the
+ * global queue, see the 0x40 registers of the queue page.
+ */
+#define TAIC_MSI_SETEIPNUM  0x0
+
+/* The priority levels of a local queue, level 0 is the highest */
+#define TAIC_PRIO_NUM       1
+#define TAIC_MAX_PRIO_NUM   64
+/* Enqueue at the default level of the local queue, see the 0x830 register */
+#define TAIC_PRIO_DEFAULT   UINT64_MAX
+
+/* The work stealing policy of a global queue, see the 0x838 register */
+#define TAIC_STEAL_DISABLED     0
+#define TAIC_STEAL_FIRST        1
+#define TAIC_STEAL_ROUND_ROBIN  2
+#define TAIC_STEAL_RANDOM       3
+#define TAIC_STEAL_VICTIM_MASK  0xff
+/* Move half of the victim's tasks into the stealing local queue */
+#define TAIC_STEAL_HALF         (1 << 8)
+#define TAIC_STEAL_HALF_MAX     32
+
+static inline bool taic_steal_policy_valid(uint64_t policy) {
+    return (policy & ~(uint64_t)(TAIC_STEAL_VICTIM_MASK | TAIC_STEAL_HALF)) == 0 &&
+           (policy & TAIC_STEAL_VICTIM_MASK) <= TAIC_STEAL_RANDOM;
+}
+
+/*
+ * The load balancing capability of a global queue, see the 0x850 register.
+ * Tasks only migrate between global queues of the same os_id.
+ */
+#define TAIC_BALANCE_EXPORT     (1 << 0)    /* other global queues may pull from it */
+#define TAIC_BALANCE_IMPORT     (1 << 1)    /* it may pull from other global queues */
+/*
+ * Also balance with the global queues of the TAICs of other sockets, both
+ * sides need it. Bits 8-15 limit the distance of the sockets an importing
+ * global queue pulls from, in the units of the NUMA distance-map of the
+ * device tree, 0 means any distance.
+ */
+#define TAIC_BALANCE_REMOTE     (1 << 2)
+#define TAIC_BALANCE_MAX_DISTANCE(v)    (((v) >> 8) & 0xff)
+#define TAIC_BALANCE_MASK       (TAIC_BALANCE_EXPORT | TAIC_BALANCE_IMPORT | TAIC_BALANCE_REMOTE | 0xff00)
+
+/*
+ * How a global queue picks the hart of a preemption IPI, see the 0x870
+ * register. TAIC_NOTIFY_IDLE prefers a hart of the hart mask (0x860/0x868)
+ * whose last dequeue found nothing, and falls back to the hart written to
+ * 0x38, or to the first hart of the mask.
+ */
+#define TAIC_NOTIFY_FIXED       0
+#define TAIC_NOTIFY_IDLE        1
+
+/*
+ * The low bits of a handler registered for an external interrupt (0x40) or
+ * a soft interrupt (0x28). A persistent handler stays registered after it is
+ * woken up, every later event queues it once more until handler 0 replaces
+ * it. Events that arrive while no handler is registered are counted and
+ * wake the next handler as soon as it is registered: a one-shot handler
+ * takes one of them, a persistent handler is queued once for each. An
+ * external interrupt is counted by the global queues that have registered
+ * a handler for it since they were allocated, until they write handler 0.
+ */
+#define TAIC_HANDLER_PREEMPT    (1 << 0)
+#define TAIC_HANDLER_PERSISTENT (1 << 1)
 
+/*
+ * The configuration word of an external interrupt source, written to
+ * 0x800 + 8 * irq of the control page. A source delivers once coalesce count
+ * events have arrived, or coalesce timeout us after the first pending event.
+ */
+#define TAIC_IRQ_LEVEL              (1ULL << 0)     /* level triggered, rising edge otherwise */
+#define TAIC_IRQ_COALESCE_COUNT(v)  (((v) >> 8) & 0xffffff)
+#define TAIC_IRQ_COALESCE_US(v)     ((v) >> 32)
+
+/*
+ * Read back from 0x0 of the control page after a failed allocation: -1 when
+ * no global or local queue is free, -2 for the reserved id (0, 0).
+ */
+#define TAIC_ALLOC_NO_SLOTS     (-1)
+#define TAIC_ALLOC_INVALID_ID   (-2)
+
+/* The error bits reported by the read_error register of each queue */
+#define TAIC_ERR_QUEUE_FULL (1 << 0)
+#define TAIC_ERR_DMA        (1 << 1)
+#define TAIC_ERR_SHM_RING   (1 << 2)
+#define TAIC_ERR_SLEEP_FULL (1 << 3)
+
+/* The log2 buckets of the wakeup latency histogram, in ns of virtual clock */
+#define TAIC_LATENCY_BUCKETS 64
+
+/* The largest shared ring a local queue can map, in entries */
+#define TAIC_SHM_RING_MAX   (1 << 20)
+
+/*
+ * Sleeping tasks of a global queue, see the 0x878-0x888 registers. Deadlines
+ * are absolute times in ticks of timebase_freq, like stimecmp, and count from
+ * the start of QEMU_CLOCK_VIRTUAL.
+ */
+#define TAIC_SLEEP_CAPACITY 256
+#define TAIC_TIMEBASE_FREQ  10000000    /* RISCV_ACLINT_DEFAULT_TIMEBASE_FREQ */
+
+// 固定容量的环形队列，容量必须是 2 的幂，head 和 tail 自由递增
 typedef struct {
-    QueueHead head;
+    uint64_t* buf;
+    int64_t* stamp;     // 每个任务的入队时间戳，只在统计唤醒延迟时分配
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
 } Queue;
 
-static inline void queue_init(Queue* queue) {
-    QSIMPLEQ_INIT(&queue->head);
+static inline void queue_init(Queue* queue, uint32_t capacity, bool stamped) {
+    queue->buf = g_new0(uint64_t, capacity);
+    queue->stamp = stamped ? g_new0(int64_t, capacity) : NULL;
+    queue->mask = capacity - 1;
+    queue->head = 0;
+    queue->tail = 0;
 }
 
-static inline void queue_push(Queue* queue, uint64_t data) {
-    struct QueueEntry *entry = g_new0(struct QueueEntry, 1);
-    entry->data = data;
-    QSIMPLEQ_INSERT_TAIL(&queue->head, entry, next);
+static inline uint32_t queue_len(Queue* queue) {
+    return queue->tail - queue->head;
 }
 
-static inline void queue_push_head(Queue* queue, uint64_t data) {
-    struct QueueEntry *entry = g_new0(struct QueueEntry, 1);
-    entry->data = data;
-    QSIMPLEQ_INSERT_HEAD(&queue->head, entry, next);
+static inline bool queue_full(Queue* queue) {
+    return queue_len(queue) > queue->mask;
 }
 
-static inline uint64_t queue_pop(Queue* queue) {
+static inline void queue_clear(Queue* queue) {
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+static inline bool queue_push(Queue* queue, uint64_t data, int64_t stamp) {
+    if(queue_full(queue)) {
+        return false;
+    }
+    queue->buf[queue->tail & queue->mask] = data;
+    if(queue->stamp != NULL) {
+        queue->stamp[queue->tail & queue->mask] = stamp;
+    }
+    queue->tail++;
+    return true;
+}
+
+static inline bool queue_push_head(Queue* queue, uint64_t data, int64_t stamp) {
+    if(queue_full(queue)) {
+        return false;
+    }
+    queue->head--;
+    queue->buf[queue->head & queue->mask] = data;
+    if(queue->stamp != NULL) {
+        queue->stamp[queue->head & queue->mask] = stamp;
+    }
+    return true;
+}
+
+// stamp 返回任务的入队时间戳，没有时间戳时为 0
+static inline uint64_t queue_pop(Queue* queue, int64_t* stamp) {
     uint64_t res = 0;
-    QueueHead *head = &queue->head;
-    if (head->sqh_first != NULL) {
-        struct QueueEntry *entry = head->sqh_first;
-        res = entry->data;
-        QSIMPLEQ_REMOVE_HEAD(head, next);
-        g_free(entry);
+    *stamp = 0;
+    if(queue->head != queue->tail) {
+        res = queue->buf[queue->head & queue->mask];
+        if(queue->stamp != NULL) {
+            *stamp = queue->stamp[queue->head & queue->mask];
+        }
+        queue->head++;
     }
     return res;
 }
 
+/************ The Shared Ring ************/
+
+// 映射到客户机内存中的环形队列，布局见 shmring.c，映射和解除映射时持有局部队列的锁
+typedef struct {
+    uint8_t* base;          // host pointer of the ring, NULL when not mapped
+    MemoryRegion* mr;
+    hwaddr offset;          // offset of the ring in mr
+    uint64_t mask;
+} ShmRing;
+
+bool shm_ring_map(ShmRing* ring, hwaddr addr, uint64_t size);
+void shm_ring_unmap(ShmRing* ring);
+bool shm_ring_push(ShmRing* ring, uint64_t data);
+bool shm_ring_pop(ShmRing* ring, uint64_t* data);
+uint64_t shm_ring_len(ShmRing* ring);
+
+static inline bool shm_ring_active(ShmRing* ring) {
+    return qatomic_read(&ring->base) != NULL;
+}
+
 /************ The External Interrupt Slots ************/
 
 // 数组的每个元素表示一个 CPU 的外部中断槽
 typedef struct {
-    uint64_t cap;
-    uint64_t state;
+    QemuSpin lock;
+    uint32_t cap;
     uint64_t* slots;
+    uint32_t* pending;  // 没有处理任务时到达的事件数
+    bool* registered;   // 注册过处理任务，直到写入处理任务 0，决定中断源的 owners
 } ExtIntrSlots;
 
 void init_extintrslots(ExtIntrSlots* extintrslots, uint64_t size);
-void register_ext(ExtIntrSlots* extintrslots, uint64_t irq, uint64_t handler);
+uint64_t register_ext(ExtIntrSlots* extintrslots, uint64_t irq, uint64_t handler);
 uint64_t wakeup_ext(ExtIntrSlots* extintrslots, uint64_t irq);
 void clean_extintrslots(ExtIntrSlots* extintrslots);
 
-/************ The Soft Interrupt Slots ************/
+/************ The Capability Table ************/
+
+// 以 (os_id, proc_id) 为键的哈希表，(0, 0) 表示空槽
 typedef struct {
-    uint64_t recv_os_id;
-    uint64_t recv_proc_id;
-} SendCap;
+    uint64_t os_id;
+    uint64_t proc_id;
+    uint64_t value;
+} CapEntry;
 
 typedef struct {
-    uint64_t send_os_id;
-    uint64_t send_proc_id;
-    uint64_t handler;
-} RecvCap;
+    uint64_t cap;
+    uint64_t count;
+    uint64_t mask;
+    CapEntry* entries;
+} CapTable;
+
+void captable_init(CapTable* table, uint64_t cap);
+CapEntry* captable_lookup(CapTable* table, uint64_t os_id, uint64_t proc_id);
+CapEntry* captable_insert(CapTable* table, uint64_t os_id, uint64_t proc_id);
+bool captable_remove(CapTable* table, uint64_t os_id, uint64_t proc_id);
+void captable_clear(CapTable* table);
+
+/************ The Soft Interrupt Slots ************/
 
 typedef struct {
+    QemuSpin lock;
     uint64_t cap;
     uint64_t state;
     uint64_t os_id;
     uint64_t proc_id;
     uint64_t task_id;
-    SendCap* sendcap;
-    RecvCap* recvcap;
+    CapTable sendcap;   // 键为接收方的 (os_id, proc_id)
+    CapTable recvcap;   // 键为发送方的 (os_id, proc_id)，值为处理任务
+    CapTable pendcap;   // 键为发送方的 (os_id, proc_id)，值为没有处理任务时到达的中断数
 } SoftIntrSlots;
 
 void init_softintrslots(SoftIntrSlots* softintrslots, uint64_t size);
 void register_send(SoftIntrSlots* softintrslots, uint64_t data);
 void cancel_send(SoftIntrSlots* softintrslots, uint64_t data);
 int64_t check_send(SoftIntrSlots* softintrslots, uint64_t recv_os_id, uint64_t recv_proc_id);
-void register_recv(SoftIntrSlots* softintrslots, uint64_t data);
+uint64_t register_recv(SoftIntrSlots* softintrslots, uint64_t data);
 uint64_t wakeup_soft(SoftIntrSlots* softintrslots, uint64_t send_os_id, uint64_t send_proc_id);
 void clean_softintrslots(SoftIntrSlots* softintrslots);
 
+/************ The Sleep Queue ************/
+
+typedef struct {
+    int64_t deadline;   // ns of QEMU_CLOCK_VIRTUAL
+    uint64_t task;
+    uint32_t lq_idx;    // 到期后任务进入的局部队列
+} SleepEntry;
+
+// 按截止时间排列的最小堆，实现见 sleepq.c
+typedef struct {
+    QemuSpin lock;
+    uint32_t cap;
+    uint32_t count;
+    SleepEntry* heap;
+} SleepQueue;
+
+void sleepq_init(SleepQueue* sleepq, uint32_t cap);
+bool sleepq_push(SleepQueue* sleepq, int64_t deadline, uint64_t task, uint32_t lq_idx);
+bool sleepq_next(SleepQueue* sleepq, int64_t* deadline);
+bool sleepq_pop_expired(SleepQueue* sleepq, int64_t now, SleepEntry* entry);
+bool sleepq_cancel(SleepQueue* sleepq, uint64_t task);
+void sleepq_cancel_lq(SleepQueue* sleepq, uint32_t lq_idx);
+void sleepq_clear(SleepQueue* sleepq);
+
 /************ The Global Queue ************/
 
 typedef struct {
+    QemuSpin lock;
     bool is_used;
-    Queue* ready_queue;
+    Queue* ready_queue;     // 每个优先级一个队列
+    uint32_t prio_num;
+    uint64_t ready_levels;  // 非空优先级的位图
+    uint64_t prio;          // 默认的入队优先级
     uint64_t count;
+    uint64_t error;
+    /* statistics, never reset while the device lives */
+    uint64_t enqs;
+    uint64_t deqs;          // 从该局部队列取出的任务数，包括被窃取的任务
+    uint64_t steals;        // 通过窃取完成的出队次数
+    uint64_t misses;        // 窃取后仍然没有任务的出队次数
+    uint64_t high_water;    // ready_queue 的最大深度
+    uint64_t* latency_hist; // 所属全局队列的唤醒延迟直方图
+    uint64_t batch_addr;    // 批量入队/出队使用的客户机物理地址
+    uint64_t batch_size;    // 批量缓冲区可以容纳的任务数
+    uint64_t shm_addr;      // 共享环形队列的客户机物理地址
+    uint64_t shm_size;      // 已映射的共享环形队列的大小，迁移后用于重新映射
+    int64_t sleep_deadline; // 下一次写入 0x880 的任务的截止时间，ns of QEMU_CLOCK_VIRTUAL
+    ShmRing shm_ring;       // 普通任务进入共享环形队列，抢占任务仍然进入 ready_queue
 } LocalQueue;
 
-void init_local_queue(LocalQueue* local_queue);
-void push_local_queue(LocalQueue* local_queue, uint64_t data, bool need_preempt);
-uint64_t pop_local_queue(LocalQueue* local_queue);
+void init_local_queue(LocalQueue* local_queue, uint32_t capacity, uint32_t prio_num, uint64_t* latency_hist);
+bool push_local_queue(LocalQueue* local_queue, uint64_t data, uint64_t prio, bool need_preempt, int64_t stamp);
+uint64_t pop_local_queue(LocalQueue* local_queue, uint64_t* prio);
+void clear_local_queue(LocalQueue* local_queue);
 
 typedef struct {
-    uint64_t state;
+    QemuSpin lock;
     uint64_t sint_state;
     uint64_t os_id;
     uint64_t proc_id;
     int64_t hart_id;
+    int64_t notified_hart;      // the hart whose software interrupt was raised last
+    unsigned long* hart_mask;   // harts running this process, hart_count bits
+    int32_t hart_count;         // size of hart_mask
+    uint64_t notify_policy;
+    uint64_t notify_cursor;     // where the search for an idle hart starts
     bool ssip;
     bool usip;
     LocalQueue* local_queue;
     ExtIntrSlots extintrslots;
     SoftIntrSlots softintrslots;
+    SleepQueue sleepq;
+    uint32_t lq_num;
+    unsigned long* nonempty;    // bitmap of the local queues with ready tasks
+    /*
+     * Bitmap of the local queues with a shared ring. The guest fills and
+     * drains the ring without trapping, so nonempty cannot track it and
+     * stealing also visits these local queues.
+     */
+    unsigned long* shm_rings;
+    uint64_t steal_policy;
+    uint64_t steal_default;     // restored when the global queue is freed
+    uint64_t steal_cursor;      // next victim of the round-robin policy
+    uint64_t steal_seed;        // xorshift state of the random policy
+    uint64_t balance_cap;
+    /* statistics, never reset while the device lives */
+    uint64_t migrations;        // tasks pulled in from other global queues
+    uint64_t preemptions;
+    uint64_t idle_notifies;     // preemption IPIs sent to an idle hart
+    uint64_t ext_delivered;
+    uint64_t ext_dropped;       // a handler was woken up but its queue was full
+    uint64_t soft_delivered;
+    uint64_t soft_dropped;
+    uint64_t timer_wakeups;
+    uint64_t timer_dropped;
+    uint64_t* latency_hist;     // log2 histogram of the wakeup to dequeue delay
     uint64_t used_lq_count;
-    int64_t sendcap_idx;
     uint64_t recv_os;
     uint64_t recv_proc;
 } GlobalQueue;
 
-void init_global_queue(GlobalQueue* global_queue);
+void init_global_queue(GlobalQueue* global_queue, uint32_t lq_num, uint32_t intr_num, uint32_t lq_capacity,
+                       uint32_t prio_num, uint32_t sleep_capacity, bool latency_hist);
+void reset_global_queue(GlobalQueue* global_queue);
+void gq_post_load(GlobalQueue* global_queue);
 int64_t alloc_lq(GlobalQueue* global_queue);
 void free_lq(GlobalQueue* global_queue, uint64_t lq_idx);
-void lq_enq(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t data, bool need_preempt);
+bool lq_enq(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t data, uint64_t prio, bool need_preempt);
 uint64_t lq_deq(GlobalQueue* global_queue, uint64_t lq_idx);
-void register_ext_handler(GlobalQueue* global_queue, uint64_t irq_idx, uint64_t data);
-void handle_extintr(GlobalQueue* global_queue, uint64_t irq_idx);
+uint64_t lq_enq_batch(GlobalQueue* global_queue, uint64_t lq_idx, const uint64_t* data, uint64_t n);
+uint64_t lq_deq_batch(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t* data, uint64_t n);
+uint64_t gq_steal(GlobalQueue* global_queue, uint64_t* data, uint64_t n);
+uint64_t lq_read_error(GlobalQueue* global_queue, uint64_t lq_idx);
+bool lq_map_shm_ring(GlobalQueue* global_queue, uint64_t lq_idx, uint64_t size);
+bool register_ext_handler(GlobalQueue* global_queue, uint64_t irq_idx, uint64_t data);
+bool handle_extintr(GlobalQueue* global_queue, uint64_t irq_idx);
 void register_sender(GlobalQueue* global_queue, uint64_t data);
 void cancel_sender(GlobalQueue* global_queue, uint64_t data);
-void register_receiver(GlobalQueue* global_queue, uint64_t data);
-void check_sendcap(GlobalQueue* global_queue, uint64_t data);
-void handle_softintr(GlobalQueue* global_queue, uint64_t send_os, uint64_t send_proc);
+bool register_receiver(GlobalQueue* global_queue, uint64_t data);
+bool check_sendcap(GlobalQueue* global_queue, uint64_t data, uint64_t* recv_os, uint64_t* recv_proc);
+bool handle_softintr(GlobalQueue* global_queue, uint64_t send_os, uint64_t send_proc);
 void write_hartid(GlobalQueue* global_queue, uint64_t data);
+bool register_sleep(GlobalQueue* global_queue, uint64_t lq_idx, int64_t deadline, uint64_t task);
+void cancel_sleep(GlobalQueue* global_queue, uint64_t task);
+bool handle_timer(GlobalQueue* global_queue, int64_t now);
+
+/************ The External Interrupt Sources ************/
+
+typedef struct {
+    QemuSpin lock;
+    void* taic;
+    uint32_t idx;
+    bool level_trigger;
+    bool level;                 // current level of the input line
+    uint32_t coalesce_count;
+    uint64_t coalesce_ns;
+    uint32_t pending;           // events not delivered yet
+    bool armed;                 // the coalescing timer is pending
+    QEMUTimer* timer;
+    unsigned long* owners;      // global queues registered for this source, until they write handler 0
+} TaicIrq;
+
+/************ The Sleep Timers ************/
+
+// 每个全局队列一个定时器，只会被提前，不会被推迟
+typedef struct {
+    void* taic;
+    uint32_t idx;
+    QEMUTimer* timer;
+} TaicTimer;
 
 /************ The TAIC Controller ************/
+typedef struct TaicFabric TaicFabric;
+
 enum TaicState {
     IDLE = 0,
     WOS = 1,
     RIDX = 2,
-    FREE_QUEUE = 3,
-    PASS_SOFT_INTR = 4,
 };
 
 typedef struct {
@@ -161,13 +445,26 @@ typedef struct {
     SysBusDevice parent_obj;
     /*< public >*/
     MemoryRegion mmio;
+    MemoryRegion msi;
     /* the properties related to cpu and other peripherals */
     qemu_irq *external_irqs;
     uint32_t hart_count;
+    uint32_t hartid_base;
     uint32_t external_irq_count;
+    uint32_t gq_num;
+    uint32_t lq_num;
+    uint32_t intr_num;
+    uint32_t lq_capacity;
+    uint32_t prio_num;
+    uint32_t steal_policy;
+    uint32_t sleep_capacity;
+    uint32_t timebase_freq;
+    bool latency_hist;
     qemu_irq* usoft_irqs;
     qemu_irq* ssoft_irqs;
     /* internal config */
+    QemuSpin ctrl_lock;     /* serializes the alloc/free protocol */
+    QemuSeqLock gq_seq;     /* protects the os_id/proc_id of each gq */
     uint64_t state;
     uint64_t os_id;
     uint64_t proc_id;
@@ -175,13 +472,42 @@ typedef struct {
     uint64_t send_proc_id;
     int64_t alloc_idx;
     GlobalQueue* gqs;
+    TaicIrq* irqs;
+    TaicTimer* timers;
+    CapTable gq_index;          // (os_id, proc_id) -> gq_idx
+    unsigned long* gq_used;
+    unsigned long* idle_harts;  // harts whose last dequeue found no task
+    TaicFabric* fabric;         // the TAICs of the other sockets, NULL with a single socket
+    uint32_t node;              // the socket of this TAIC in fabric
 }TAICState;
 
 #define TYPE_TAIC "taic"
 DECLARE_INSTANCE_CHECKER(TAICState, TAIC, TYPE_TAIC)
 
+void taic_stats_class_init(ObjectClass* oc);
+extern const VMStateDescription vmstate_taic;
+// 根据全局队列的 ssip/usip 标志发出或撤销软件中断
+void taic_raise_softirq(TAICState* taic, uint64_t gq_idx);
+void taic_lower_softirq(TAICState* taic, uint64_t gq_idx);
+void taic_register_ext(TAICState* taic, uint64_t gq_idx, uint64_t irq_idx, uint64_t data);
+void taic_sim_extintr(TAICState* taic, uint64_t irq_idx);
+void taic_note_deq(TAICState* taic, bool empty);
+void taic_rearm_timer(TAICState* taic, uint64_t gq_idx);
+
+/************ The TAIC Fabric ************/
+
+// 连接所有 socket 的 TAIC，实现见 fabric.c
+TaicFabric* taic_fabric_new(uint32_t num);
+void taic_fabric_add(TaicFabric* fabric, uint32_t node, TAICState* taic);
+void taic_fabric_set_distance(TaicFabric* fabric, uint32_t a, uint32_t b, uint8_t distance);
+bool taic_fabric_send_softintr(TAICState* taic, uint64_t send_os, uint64_t send_proc, uint64_t recv_os,
+                               uint64_t recv_proc);
+uint64_t taic_fabric_migrate(TAICState* taic, uint64_t gq_idx, uint64_t* data, uint64_t n);
+
 // init the internal configuration when create taic instance
 static inline void taic_init(TAICState* taic) {
+    qemu_spin_init(&taic->ctrl_lock);
+    seqlock_init(&taic->gq_seq);
     taic->state = IDLE;
     taic->os_id = 0;
     taic->proc_id = 0;
@@ -189,86 +515,140 @@ static inline void taic_init(TAICState* taic) {
     taic->send_proc_id = 0;
     taic->alloc_idx = 0;
     int i = 0;
-    taic->gqs = g_new0(GlobalQueue, GQ_NUM);
-    for(i = 0; i < GQ_NUM; i++) {
-        init_global_queue(&(taic->gqs[i]));
+    captable_init(&taic->gq_index, taic->gq_num);
+    taic->gq_used = bitmap_new(taic->gq_num);
+    taic->idle_harts = bitmap_new(taic->hart_count);
+    taic->gqs = g_new0(GlobalQueue, taic->gq_num);
+    for(i = 0; i < taic->gq_num; i++) {
+        init_global_queue(&(taic->gqs[i]), taic->lq_num, taic->intr_num, taic->lq_capacity, taic->prio_num,
+                          taic->sleep_capacity, taic->latency_hist);
+        taic->gqs[i].hart_mask = bitmap_new(taic->hart_count);
+        taic->gqs[i].hart_count = taic->hart_count;
+        taic->gqs[i].steal_policy = taic->steal_policy;
+        taic->gqs[i].steal_default = taic->steal_policy;
     }
 }
 
 static inline int64_t taic_read_alloc_idx(TAICState* taic) {
-    uint64_t state = 0;
     while(1) {
-        state = qatomic_cmpxchg(&taic->state, RIDX, IDLE);
-        if(state == RIDX) {
+        qemu_spin_lock(&taic->ctrl_lock);
+        if(taic->state == RIDX) {
             int64_t res = taic->alloc_idx;
-            qatomic_set(&taic->state, IDLE);
+            taic->state = IDLE;
+            qemu_spin_unlock(&taic->ctrl_lock);
             return res;
         }
+        qemu_spin_unlock(&taic->ctrl_lock);
     }
 }
 
 static inline void taic_alloc_gq(TAICState* taic, uint64_t data) {
-    uint64_t state = 0;
     while(1) {
-        state = qatomic_cmpxchg(&taic->state, IDLE, WOS);
-        if (state == IDLE) {
+        qemu_spin_lock(&taic->ctrl_lock);
+        if (taic->state == IDLE) {
             taic->os_id = data;
+            taic->state = WOS;
+            qemu_spin_unlock(&taic->ctrl_lock);
             return;
-        } else if (state == WOS) {
+        } else if (taic->state == WOS) {
             taic->proc_id = data;
-            int i = 0;
             uint64_t os_id = taic->os_id;
             uint64_t proc_id = data;
             int64_t idx = -1;
-            for(i = GQ_NUM - 1; i >= 0; i--) {
-                if(taic->gqs[i].os_id == os_id && taic->gqs[i].proc_id == proc_id) {
-                    idx = i;
-                    break;
-                } else if (taic->gqs[i].os_id == 0 && taic->gqs[i].proc_id == 0) {
-                    idx = i;
-                }
+            taic->state = RIDX;
+            if(os_id == 0 && proc_id == 0) {    // (0, 0) 表示空闲的全局队列
+                // error_report("Invalid os_id and proc_id");
+                taic->alloc_idx = TAIC_ALLOC_INVALID_ID;
+                qemu_spin_unlock(&taic->ctrl_lock);
+                return;
             }
-            if(idx != -1) {
-                taic->gqs[idx].os_id = os_id;
-                taic->gqs[idx].proc_id = proc_id;
+            CapEntry* entry = captable_lookup(&taic->gq_index, os_id, proc_id);
+            if(entry != NULL) {
+                idx = entry->value;
             } else {
+                idx = find_first_zero_bit(taic->gq_used, taic->gq_num);
+                if(idx < taic->gq_num) {
+                    seqlock_write_begin(&taic->gq_seq);
+                    entry = captable_insert(&taic->gq_index, os_id, proc_id);
+                    entry->value = idx;
+                    set_bit(idx, taic->gq_used);
+                    qatomic_set(&taic->gqs[idx].os_id, os_id);
+                    qatomic_set(&taic->gqs[idx].proc_id, proc_id);
+                    seqlock_write_end(&taic->gq_seq);
+                } else {
+                    idx = -1;
+                }
+            }
+            if(idx == -1) {
                 error_report("No global queue slots");
-                taic->alloc_idx = -1;
-                taic->alloc_idx = -1;
-                qatomic_set(&taic->state, RIDX);
+                taic->alloc_idx = TAIC_ALLOC_NO_SLOTS;
+                qemu_spin_unlock(&taic->ctrl_lock);
                 return;
             }
             // 分配好全局队列，分配局部队列
             int64_t lq_idx = alloc_lq(&(taic->gqs[idx]));
             if(lq_idx == -1) {
                 error_report("No local queue slots");
-                taic->alloc_idx = -1;
-                qatomic_set(&taic->state, RIDX);
+                taic->alloc_idx = TAIC_ALLOC_NO_SLOTS;
+                qemu_spin_unlock(&taic->ctrl_lock);
                 return;
             }
             taic->alloc_idx = ((idx & 0xffffffff) << 32) | (lq_idx & 0xffffffff);
-            qatomic_set(&taic->state, RIDX);
+            qemu_spin_unlock(&taic->ctrl_lock);
             return;
         }
+        qemu_spin_unlock(&taic->ctrl_lock);
     }
 }
 
 static inline void taic_free_gq(TAICState* taic, uint64_t idx) {
     uint64_t gq_idx = (idx >> 32) & 0xffffffff;
     uint64_t lq_idx = idx & 0xffffffff;
-    uint64_t state = 0;
+    if(gq_idx >= taic->gq_num) {
+        // error_report("Invalid gq_idx");
+        return;
+    }
     while(1) {
-        state = qatomic_cmpxchg(&taic->state, IDLE, FREE_QUEUE);
-        if(state == IDLE) {
-            free_lq(&(taic->gqs[gq_idx]), lq_idx);
-            qatomic_set(&taic->state, IDLE);
+        qemu_spin_lock(&taic->ctrl_lock);
+        if(taic->state == IDLE) {
+            GlobalQueue* gq = &(taic->gqs[gq_idx]);
+            uint64_t os_id = gq->os_id;
+            uint64_t proc_id = gq->proc_id;
+            seqlock_write_begin(&taic->gq_seq);
+            free_lq(gq, lq_idx);
+            // 最后一个局部队列被释放后，全局队列也被释放
+            if(test_bit(gq_idx, taic->gq_used) && gq->os_id == 0 && gq->proc_id == 0) {
+                captable_remove(&taic->gq_index, os_id, proc_id);
+                clear_bit(gq_idx, taic->gq_used);
+                for(uint64_t h = 0; h < taic->hart_count; h++) {
+                    clear_bit_atomic(h, gq->hart_mask);
+                }
+                for(uint64_t irq = 0; irq < taic->intr_num; irq++) {
+                    clear_bit_atomic(gq_idx, taic->irqs[irq].owners);
+                }
+            }
+            seqlock_write_end(&taic->gq_seq);
+            qemu_spin_unlock(&taic->ctrl_lock);
             return;
         }
+        qemu_spin_unlock(&taic->ctrl_lock);
     }
 }
 
-static inline void taic_lq_enq(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx, uint64_t data) {
-    if(gq_idx >= GQ_NUM) {
+// 根据 (os_id, proc_id) 查找全局队列，不持有 ctrl_lock
+static inline int64_t taic_find_gq(TAICState* taic, uint64_t os_id, uint64_t proc_id) {
+    int64_t idx = -1;
+    unsigned seq;
+    do {
+        seq = seqlock_read_begin(&taic->gq_seq);
+        CapEntry* entry = captable_lookup(&taic->gq_index, os_id, proc_id);
+        idx = entry != NULL ? qatomic_read(&entry->value) : -1;
+    } while(seqlock_read_retry(&taic->gq_seq, seq));
+    return idx;
+}
+
+static inline void taic_lq_enq(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx, uint64_t prio, uint64_t data) {
+    if(gq_idx >= taic->gq_num) {
         // error_report("Invalid gq_idx");
         return;
     }
@@ -276,11 +656,38 @@ static inline void taic_lq_enq(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx
         // error_report("Not used GQ");
         return;
     }
-    lq_enq(&(taic->gqs[gq_idx]), lq_idx, data, false);
+    lq_enq(&(taic->gqs[gq_idx]), lq_idx, data, prio, false);
+}
+
+// 从同一个 OS 中允许导出的其他全局队列迁移任务，本地没有时再从其他 socket 迁移
+static inline uint64_t taic_migrate(TAICState* taic, uint64_t gq_idx, uint64_t* data, uint64_t n) {
+    GlobalQueue* gq = &(taic->gqs[gq_idx]);
+    if(!(qatomic_read(&gq->balance_cap) & TAIC_BALANCE_IMPORT)) {
+        return 0;
+    }
+    uint64_t os_id = qatomic_read(&gq->os_id);
+    for(uint64_t i = 1; i < taic->gq_num; i++) {
+        GlobalQueue* victim = &(taic->gqs[(gq_idx + i) % taic->gq_num]);
+        if(qatomic_read(&victim->os_id) != os_id || qatomic_read(&victim->proc_id) == gq->proc_id) {
+            continue;
+        }
+        if(os_id == 0 && qatomic_read(&victim->proc_id) == 0) {     // 空闲的全局队列
+            continue;
+        }
+        if(!(qatomic_read(&victim->balance_cap) & TAIC_BALANCE_EXPORT)) {
+            continue;
+        }
+        uint64_t res = gq_steal(victim, data, n);
+        if(res != 0) {
+            qatomic_add(&gq->migrations, res);
+            return res;
+        }
+    }
+    return taic_fabric_migrate(taic, gq_idx, data, n);
 }
 
 static inline uint64_t taic_lq_deq(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx) {
-    if(gq_idx >= GQ_NUM) {
+    if(gq_idx >= taic->gq_num) {
         // error_report("Enq Invalid gq_idx");
         return 0;
     }
@@ -288,45 +695,97 @@ static inline uint64_t taic_lq_deq(TAICState* taic, uint64_t gq_idx, uint64_t lq
         // error_report("Enq Not used GQ");
         return 0;
     }
-    int64_t hartid = taic->gqs[gq_idx].hart_id;
-    if(hartid != -1) {
-        if(taic->gqs[gq_idx].ssip == true) {
-            qemu_irq_lower(taic->ssoft_irqs[hartid]);
-        } else if(taic->gqs[gq_idx].usip == true) {
-            qemu_irq_lower(taic->usoft_irqs[hartid]);
-        }
+    taic_lower_softirq(taic, gq_idx);
+    uint64_t res = lq_deq(&(taic->gqs[gq_idx]), lq_idx);
+    if(res == 0) {
+        taic_migrate(taic, gq_idx, &res, 1);
+    }
+    taic_note_deq(taic, res == 0);
+    return res;
+}
+
+static inline LocalQueue* taic_local_queue(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx) {
+    if(gq_idx >= taic->gq_num || lq_idx >= taic->lq_num) {
+        // error_report("Invalid gq_idx");
+        return NULL;
+    }
+    if(!qatomic_read(&taic->gqs[gq_idx].local_queue[lq_idx].is_used)) {
+        // error_report("Not used LQ");
+        return NULL;
     }
-    return lq_deq(&(taic->gqs[gq_idx]), lq_idx);
+    return &(taic->gqs[gq_idx].local_queue[lq_idx]);
 }
 
-static inline void taic_register_ext(TAICState* taic, uint64_t gq_idx, uint64_t irq_idx, uint64_t data) {
-    if(gq_idx >= GQ_NUM) {
-        // error_report("Deq Invalid gq_idx");
+static inline void taic_set_steal_policy(TAICState* taic, uint64_t gq_idx, uint64_t policy) {
+    if(gq_idx >= taic->gq_num) {
+        // error_report("Invalid gq_idx");
         return;
     }
     if(taic->gqs[gq_idx].os_id == 0 && taic->gqs[gq_idx].proc_id == 0) {
-        // error_report("Deq Not used GQ");
+        // error_report("Not used GQ");
         return;
     }
-    register_ext_handler(&(taic->gqs[gq_idx]), irq_idx, data);
+    if(!taic_steal_policy_valid(policy)) {
+        // error_report("Invalid steal policy");
+        return;
+    }
+    qatomic_set(&taic->gqs[gq_idx].steal_policy, policy);
 }
 
-static inline void taic_sim_extintr(TAICState* taic, uint64_t irq_idx) {
-    for(int i = 0; i < GQ_NUM; i++) {
-        handle_extintr(&(taic->gqs[i]), irq_idx);
-        int64_t hartid = taic->gqs[i].hart_id;
-        if(hartid != -1) {
-            if(taic->gqs[i].ssip == true) {
-                qemu_irq_raise(taic->ssoft_irqs[hartid]);
-            } else if(taic->gqs[i].usip == true) {
-                qemu_irq_raise(taic->usoft_irqs[hartid]);
-            }
-        }
+static inline void taic_set_balance_cap(TAICState* taic, uint64_t gq_idx, uint64_t cap) {
+    if(gq_idx >= taic->gq_num) {
+        // error_report("Invalid gq_idx");
+        return;
+    }
+    if(taic->gqs[gq_idx].os_id == 0 && taic->gqs[gq_idx].proc_id == 0) {
+        // error_report("Not used GQ");
+        return;
+    }
+    qatomic_set(&taic->gqs[gq_idx].balance_cap, cap & TAIC_BALANCE_MASK);
+}
+
+static inline void taic_set_hart(TAICState* taic, uint64_t gq_idx, uint64_t hartid, bool add) {
+    if(gq_idx >= taic->gq_num || hartid >= taic->hart_count) {
+        // error_report("Invalid gq_idx or hartid");
+        return;
+    }
+    if(taic->gqs[gq_idx].os_id == 0 && taic->gqs[gq_idx].proc_id == 0) {
+        // error_report("Not used GQ");
+        return;
+    }
+    if(add) {
+        set_bit_atomic(hartid, taic->gqs[gq_idx].hart_mask);
+    } else {
+        clear_bit_atomic(hartid, taic->gqs[gq_idx].hart_mask);
     }
 }
 
+static inline void taic_set_notify_policy(TAICState* taic, uint64_t gq_idx, uint64_t policy) {
+    if(gq_idx >= taic->gq_num) {
+        // error_report("Invalid gq_idx");
+        return;
+    }
+    if(taic->gqs[gq_idx].os_id == 0 && taic->gqs[gq_idx].proc_id == 0) {
+        // error_report("Not used GQ");
+        return;
+    }
+    if(policy > TAIC_NOTIFY_IDLE) {
+        // error_report("Invalid notify policy");
+        return;
+    }
+    qatomic_set(&taic->gqs[gq_idx].notify_policy, policy);
+}
+
+static inline uint64_t taic_read_error(TAICState* taic, uint64_t gq_idx, uint64_t lq_idx) {
+    if(gq_idx >= taic->gq_num) {
+        // error_report("Invalid gq_idx");
+        return 0;
+    }
+    return lq_read_error(&(taic->gqs[gq_idx]), lq_idx);
+}
+
 static inline void taic_register_sender(TAICState* taic, uint64_t gq_idx, uint64_t data) {
-    if(gq_idx >= GQ_NUM) {
+    if(gq_idx >= taic->gq_num) {
         // error_report("Invalid gq_idx");
         return;
     }
@@ -338,7 +797,7 @@ static inline void taic_register_sender(TAICState* taic, uint64_t gq_idx, uint64
 }
 
 static inline void taic_cancel_sender(TAICState* taic, uint64_t gq_idx, uint64_t data) {
-    if(gq_idx >= GQ_NUM) {
+    if(gq_idx >= taic->gq_num) {
         // error_report("Invalid gq_idx");
         return;
     }
@@ -350,7 +809,7 @@ static inline void taic_cancel_sender(TAICState* taic, uint64_t gq_idx, uint64_t
 }
 
 static inline void taic_register_receiver(TAICState* taic, uint64_t gq_idx, uint64_t data) {
-    if(gq_idx >= GQ_NUM) {
+    if(gq_idx >= taic->gq_num) {
         // error_report("Invalid gq_idx");
         return;
     }
@@ -358,11 +817,14 @@ static inline void taic_register_receiver(TAICState* taic, uint64_t gq_idx, uint
         // error_report("Not used GQ");
         return;
     }
-    register_receiver(&(taic->gqs[gq_idx]), data);
+    // 注册时有待处理的中断，立即唤醒处理任务
+    if(register_receiver(&(taic->gqs[gq_idx]), data)) {
+        taic_raise_softirq(taic, gq_idx);
+    }
 }
 
 static inline void taic_send_softintr(TAICState* taic, uint64_t gq_idx, uint64_t data) {
-    if(gq_idx >= GQ_NUM) {
+    if(gq_idx >= taic->gq_num) {
         // error_report("Invalid gq_idx");
         return;
     }
@@ -370,47 +832,49 @@ static inline void taic_send_softintr(TAICState* taic, uint64_t gq_idx, uint64_t
         // error_report("Not used GQ");
         return;
     }
-    uint64_t state = 0;
-    while (1) {
-        state = qatomic_cmpxchg(&taic->state, IDLE, PASS_SOFT_INTR);
-        if(state == IDLE) {
-            check_sendcap(&(taic->gqs[gq_idx]), data);
-            return;
-        } else if(state == PASS_SOFT_INTR) {
-            check_sendcap(&(taic->gqs[gq_idx]), data);
-            if(taic->gqs[gq_idx].sendcap_idx != -1) {   // 有发送能力，检查接收方的能力
-                uint64_t recv_os = taic->gqs[gq_idx].recv_os;
-                uint64_t recv_proc = taic->gqs[gq_idx].recv_proc;
-                uint64_t send_os = taic->gqs[gq_idx].os_id;
-                uint64_t send_proc = taic->gqs[gq_idx].proc_id;
-                // 找到对应的接收方的全局队列
-                int idx = -1;
-                for(int i = 0; i < GQ_NUM; i++) {
-                    if(taic->gqs[i].os_id == recv_os && taic->gqs[i].proc_id == recv_proc) {
-                        idx = i;
-                        break;
-                    }
-                }
-                if(idx != -1) {     // 找到了对应的接收方的全局队列，处理中断
-                    handle_softintr(&(taic->gqs[idx]), send_os, send_proc);
-                    int64_t hartid = taic->gqs[idx].hart_id;
-                    if(hartid != -1) {
-                        if(taic->gqs[idx].ssip == true) {
-                            qemu_irq_raise(taic->ssoft_irqs[hartid]);
-                        } else if(taic->gqs[idx].usip == true) {
-                            qemu_irq_raise(taic->usoft_irqs[hartid]);
-                        }
-                    }
-                }
-            }
-            qatomic_set(&taic->state, IDLE);
-            return;
+    uint64_t recv_os = 0;
+    uint64_t recv_proc = 0;
+    // 第二次写入时完成发送能力检查，有发送能力时检查接收方的能力
+    if(!check_sendcap(&(taic->gqs[gq_idx]), data, &recv_os, &recv_proc)) {
+        return;
+    }
+    // 与 taic_free_gq 并发时，读到的发送方 (os_id, proc_id) 必须是一致的
+    uint64_t send_os, send_proc;
+    unsigned seq;
+    do {
+        seq = seqlock_read_begin(&taic->gq_seq);
+        send_os = qatomic_read(&taic->gqs[gq_idx].os_id);
+        send_proc = qatomic_read(&taic->gqs[gq_idx].proc_id);
+    } while(seqlock_read_retry(&taic->gq_seq, seq));
+    if(send_os == 0 && send_proc == 0) {
+        // error_report("Not used GQ");
+        return;
+    }
+    // 找到对应的接收方的全局队列
+    int64_t idx = taic_find_gq(taic, recv_os, recv_proc);
+    if(idx != -1) {     // 找到了对应的接收方的全局队列，处理中断
+        if(handle_softintr(&(taic->gqs[idx]), send_os, send_proc)) {
+            taic_raise_softirq(taic, idx);
         }
+    } else {            // 接收方在其他 socket 上
+        taic_fabric_send_softintr(taic, send_os, send_proc, recv_os, recv_proc);
     }
 }
 
+static inline void taic_cancel_sleep(TAICState* taic, uint64_t gq_idx, uint64_t task) {
+    if(gq_idx >= taic->gq_num) {
+        // error_report("Invalid gq_idx");
+        return;
+    }
+    if(taic->gqs[gq_idx].os_id == 0 && taic->gqs[gq_idx].proc_id == 0) {
+        // error_report("Not used GQ");
+        return;
+    }
+    cancel_sleep(&(taic->gqs[gq_idx]), task);
+}
+
 static inline void taic_write_hartid(TAICState* taic, uint64_t gq_idx, uint64_t data) {
-    if(gq_idx >= GQ_NUM) {
+    if(gq_idx >= taic->gq_num || data >= taic->hart_count) {
         // error_report("Invalid gq_idx");
         return;
     }
@@ -419,17 +883,12 @@ static inline void taic_write_hartid(TAICState* taic, uint64_t gq_idx, uint64_t
         return;
     }
     write_hartid(&(taic->gqs[gq_idx]), data);
-    int64_t hartid = taic->gqs[gq_idx].hart_id;
-    if(hartid != -1) {
-        if(taic->gqs[gq_idx].ssip == true) {
-            qemu_irq_raise(taic->ssoft_irqs[hartid]);
-        } else if(taic->gqs[gq_idx].usip == true) {
-            qemu_irq_raise(taic->usoft_irqs[hartid]);
-        }
-    }
+    taic_raise_softirq(taic, gq_idx);
 }
 
-DeviceState *taic_create(hwaddr addr, uint32_t hart_count, uint32_t external_irq_count);
+DeviceState *taic_create(hwaddr addr, hwaddr msi_addr, uint32_t hartid_base,
+                         uint32_t hart_count, uint32_t external_irq_count, uint32_t gq_num, uint32_t lq_num,
+                         uint32_t intr_num);
 
 
 #endif
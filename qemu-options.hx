@@ -187,6 +187,8 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                one-insn-per-tb=on|off (one guest instruction per TCG translation block)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                tlb-min-bits=n (log2 of the minimum TCG TLB size)\n"
+    "                vtlb-size=n (TCG victim TLB entries, default 8)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
@@ -230,6 +232,19 @@ SRST
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``tlb-min-bits=n``
+        Keeps the softmmu TLB of every MMU mode at 2^n entries or more.
+        The TLB is normally shrunk when its use rate is low, which can
+        cause many refills for guests with large, sparse working sets.
+        Every MMU mode of every vCPU gets a TLB of at least this size, so
+        large values use a lot of host memory. Only available in system
+        emulation.
+
+    ``vtlb-size=n``
+        Controls the number of entries (1 to 256, default 8) in the fully
+        associative victim TLB that catches entries evicted from the
+        softmmu TLB. Only available in system emulation.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefore taking advantage of
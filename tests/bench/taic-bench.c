@@ -0,0 +1,314 @@
+/*
+ * Multi-threaded benchmark of the TAIC queue and interrupt slot code
+ *
+ * The queue.c/softint.c/extint.c/captable.c sources of hw/taic are linked
+ * in directly, so this measures the data structures without MMIO or vCPU
+ * overhead.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/host-utils.h"
+#include "qemu/processor.h"
+#include "hw/taic.h"
+
+enum bench_mode {
+    MODE_LQ,        /* enq + deq on the thread's own local queue */
+    MODE_SHARED,    /* enq + deq on local queue 0 of one global queue */
+    MODE_STEAL,     /* even threads enq, odd threads deq by stealing */
+    MODE_EXTINT,    /* register + wake up an external handler, then deq */
+    MODE_SOFTINT,   /* register a receiver + send a soft interrupt, then deq */
+};
+
+static const char * const mode_names[] = {
+    [MODE_LQ] = "lq",
+    [MODE_SHARED] = "shared",
+    [MODE_STEAL] = "steal",
+    [MODE_EXTINT] = "extint",
+    [MODE_SOFTINT] = "softint",
+};
+
+struct thread_info {
+    unsigned int idx;
+    GlobalQueue *gq;
+    uint64_t lq;
+    unsigned long ops;
+} QEMU_ALIGNED(64);
+
+static QemuThread *threads;
+static struct thread_info *th_info;
+static GlobalQueue *gqs;
+static unsigned int n_gqs;
+static unsigned int n_threads = 1;
+static unsigned int n_ready_threads;
+static unsigned int duration = 1;
+static unsigned int capacity = 1024;
+static unsigned int steal_policy = TAIC_STEAL_FIRST;
+static enum bench_mode mode = MODE_LQ;
+static bool test_start;
+static bool test_stop;
+
+static const char commands_string[] =
+    " -n = number of threads\n"
+    " -d = duration in seconds\n"
+    " -c = local queue capacity (will be rounded up to pow2)\n"
+    " -s = steal policy, as written to the 0x838 register\n"
+    " -m = mode: lq, shared, steal, extint or softint";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/*
+ * Shared rings live in guest memory, which does not exist here; the local
+ * queues fall back to their internal ready queues.
+ */
+bool shm_ring_map(ShmRing *ring, hwaddr addr, uint64_t size)
+{
+    return false;
+}
+
+void shm_ring_unmap(ShmRing *ring)
+{
+}
+
+bool shm_ring_push(ShmRing *ring, uint64_t data)
+{
+    return false;
+}
+
+bool shm_ring_pop(ShmRing *ring, uint64_t *data)
+{
+    return false;
+}
+
+uint64_t shm_ring_len(ShmRing *ring)
+{
+    return 0;
+}
+
+static unsigned long do_lq(struct thread_info *info, uint64_t task)
+{
+    if (lq_enq(info->gq, info->lq, task, TAIC_PRIO_DEFAULT, false)) {
+        lq_deq(info->gq, info->lq);
+        return 2;
+    }
+    return 0;
+}
+
+static unsigned long do_steal(struct thread_info *info, uint64_t task)
+{
+    if (info->idx % 2 == 0) {
+        return lq_enq(info->gq, info->lq, task, TAIC_PRIO_DEFAULT, false);
+    }
+    return lq_deq(info->gq, info->lq) != 0;
+}
+
+static unsigned long do_extint(struct thread_info *info, uint64_t task)
+{
+    /* the low bits of a handler are flags, keep them clear */
+    register_ext_handler(info->gq, 0, task << 2);
+    handle_extintr(info->gq, 0);
+    return lq_deq(info->gq, info->lq) != 0;
+}
+
+static unsigned long do_softint(struct thread_info *info, uint64_t task)
+{
+    /* the sender is the thread itself, as os 1 and proc idx + 1 */
+    register_receiver(info->gq, 1);
+    register_receiver(info->gq, info->idx + 1);
+    register_receiver(info->gq, task << 2);
+    handle_softintr(info->gq, 1, info->idx + 1);
+    return lq_deq(info->gq, info->lq) != 0;
+}
+
+static void *thread_func(void *arg)
+{
+    struct thread_info *info = arg;
+    uint64_t task = 1;
+
+    qatomic_inc(&n_ready_threads);
+    while (!qatomic_read(&test_start)) {
+        cpu_relax();
+    }
+
+    while (!qatomic_read(&test_stop)) {
+        unsigned long n;
+
+        switch (mode) {
+        case MODE_LQ:
+        case MODE_SHARED:
+            n = do_lq(info, task);
+            break;
+        case MODE_STEAL:
+            n = do_steal(info, task);
+            break;
+        case MODE_EXTINT:
+            n = do_extint(info, task);
+            break;
+        case MODE_SOFTINT:
+            n = do_softint(info, task);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        info->ops += n;
+        task++;
+    }
+    return NULL;
+}
+
+static void run_test(void)
+{
+    unsigned int i;
+
+    while (qatomic_read(&n_ready_threads) != n_threads) {
+        cpu_relax();
+    }
+
+    qatomic_set(&test_start, true);
+    g_usleep(duration * G_USEC_PER_SEC);
+    qatomic_set(&test_stop, true);
+
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
+static void create_gqs(void)
+{
+    unsigned int lq_num = mode == MODE_SHARED ? 1 : n_threads;
+    unsigned int i, j;
+
+    /* the interrupt modes give every thread its own receiving global queue */
+    n_gqs = mode == MODE_EXTINT || mode == MODE_SOFTINT ? n_threads : 1;
+    if (n_gqs > 1) {
+        lq_num = 1;
+    }
+    gqs = g_new0(GlobalQueue, n_gqs);
+    for (i = 0; i < n_gqs; i++) {
+        GlobalQueue *gq = &gqs[i];
+
+        init_global_queue(gq, lq_num, 1, capacity, TAIC_PRIO_NUM, TAIC_SLEEP_CAPACITY, false);
+        gq->os_id = 1;
+        gq->proc_id = i + 1;
+        gq->steal_policy = steal_policy;
+        for (j = 0; j < lq_num; j++) {
+            g_assert(alloc_lq(gq) == j);
+        }
+    }
+}
+
+static void create_threads(void)
+{
+    unsigned int i;
+
+    threads = g_new(QemuThread, n_threads);
+    th_info = g_new0(struct thread_info, n_threads);
+
+    for (i = 0; i < n_threads; i++) {
+        struct thread_info *info = &th_info[i];
+
+        info->idx = i;
+        if (n_gqs > 1) {
+            info->gq = &gqs[i];
+            info->lq = 0;
+        } else {
+            info->gq = &gqs[0];
+            info->lq = mode == MODE_SHARED ? 0 : i;
+        }
+        qemu_thread_create(&threads[i], NULL, thread_func, info,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" # of threads:      %u\n", n_threads);
+    printf(" duration:          %u\n", duration);
+    printf(" mode:              %s\n", mode_names[mode]);
+    printf(" lq capacity:       %u\n", capacity);
+    printf(" steal policy:      0x%x\n", steal_policy);
+}
+
+static void pr_stats(void)
+{
+    unsigned long long val = 0;
+    unsigned int i;
+    double tx;
+
+    for (i = 0; i < n_threads; i++) {
+        val += th_info[i].ops;
+    }
+    tx = val / duration / 1e6;
+
+    printf("Results:\n");
+    printf("Duration:            %u s\n", duration);
+    printf(" Throughput:         %.2f Mops/s\n", tx);
+    printf(" Throughput/thread:  %.2f Mops/s/thread\n", tx / n_threads);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    unsigned int i;
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:n:c:s:m:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_threads = atoi(optarg);
+            break;
+        case 'c':
+            capacity = pow2ceil(atoi(optarg));
+            break;
+        case 's':
+            steal_policy = strtoul(optarg, NULL, 0);
+            if (!taic_steal_policy_valid(steal_policy)) {
+                fprintf(stderr, "Invalid steal policy 0x%x\n", steal_policy);
+                exit(1);
+            }
+            break;
+        case 'm':
+            for (i = 0; i < ARRAY_SIZE(mode_names); i++) {
+                if (!strcmp(optarg, mode_names[i])) {
+                    mode = i;
+                    break;
+                }
+            }
+            if (i == ARRAY_SIZE(mode_names)) {
+                usage_complete(argv);
+                exit(1);
+            }
+            break;
+        }
+    }
+    if (n_threads == 0 || duration == 0 || capacity == 0) {
+        usage_complete(argv);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    pr_params();
+    create_gqs();
+    create_threads();
+    run_test();
+    pr_stats();
+    return 0;
+}
@@ -0,0 +1,558 @@
+/*
+ * QTest testcase and microbenchmark for the Task-Aware Interrupt Controller
+ *
+ * The guest is never started: every queue operation is an MMIO access from
+ * the qtest protocol, so the functional tests run in any environment and the
+ * benchmarks (-m perf) measure the device model rather than guest code.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "libqtest.h"
+
+#define TAIC_BASE           0x1000000
+#define TAIC_REMOTE_BASE    0x11000000      /* socket 1 */
+#define TAIC_MSI_BASE       0x800000
+#define TAIC_PAGE_SIZE      0x1000
+#define GQ_NUM              4
+#define LQ_NUM              8
+
+/* control page */
+#define TAIC_ALLOC          0x0
+#define TAIC_FREE           0x8
+#define TAIC_SIM_EXT(irq)   (0x10 + 8 * (irq))
+#define TAIC_ALLOC_NO_SLOTS     -1
+#define TAIC_ALLOC_INVALID_ID   -2
+
+/* queue page */
+#define TAIC_ENQ            0x0
+#define TAIC_DEQ            0x08
+#define TAIC_ERROR          0x10
+#define TAIC_REG_SENDER     0x18
+#define TAIC_REG_RECEIVER   0x28
+#define TAIC_SEND_SOFT      0x30
+#define TAIC_REG_EXT(irq)   (0x40 + 8 * (irq))
+#define TAIC_SHM_ADDR       0x820
+#define TAIC_SHM_SIZE       0x828
+#define TAIC_STEAL_POLICY   0x838
+#define TAIC_STEALS         0x840
+#define TAIC_SLEEP_DEADLINE 0x878
+#define TAIC_SLEEP          0x880
+#define TAIC_CANCEL_SLEEP   0x888
+
+/* ticks of the default 10 MHz timebase */
+#define TAIC_TICKS_PER_MS   10000
+
+#define TAIC_STEAL_DISABLED 0
+#define TAIC_STEAL_FIRST    1
+#define TAIC_STEAL_HALF     (1 << 8)
+#define TAIC_HANDLER_PERSISTENT 0x2
+
+#define BENCH_OPS           100000
+
+static QTestState *taic_start(void)
+{
+    return qtest_initf("-machine virt,taic-gq-num=%d,taic-lq-num=%d",
+                       GQ_NUM, LQ_NUM);
+}
+
+/* Two sockets with one hart each */
+static QTestState *taic_start_numa(void)
+{
+    return qtest_initf("-machine virt,taic-gq-num=%d,taic-lq-num=%d "
+                       "-smp 2 -m 256M "
+                       "-object memory-backend-ram,id=m0,size=128M "
+                       "-object memory-backend-ram,id=m1,size=128M "
+                       "-numa node,nodeid=0,cpus=0,memdev=m0 "
+                       "-numa node,nodeid=1,cpus=1,memdev=m1",
+                       GQ_NUM, LQ_NUM);
+}
+
+/* Allocate a local queue of the global queue of (os_id, proc_id) */
+static uint64_t taic_alloc_at(QTestState *qts, uint64_t base,
+                              uint64_t os_id, uint64_t proc_id)
+{
+    qtest_writeq(qts, base + TAIC_ALLOC, os_id);
+    qtest_writeq(qts, base + TAIC_ALLOC, proc_id);
+    return qtest_readq(qts, base + TAIC_ALLOC);
+}
+
+static uint64_t taic_alloc(QTestState *qts, uint64_t os_id, uint64_t proc_id)
+{
+    return taic_alloc_at(qts, TAIC_BASE, os_id, proc_id);
+}
+
+static void taic_free(QTestState *qts, uint64_t idx)
+{
+    qtest_writeq(qts, TAIC_BASE + TAIC_FREE, idx);
+}
+
+static uint64_t taic_gq(uint64_t idx)
+{
+    return idx >> 32;
+}
+
+static uint64_t taic_page_at(uint64_t base, uint64_t idx)
+{
+    uint64_t gq = idx >> 32;
+    uint64_t lq = idx & 0xffffffff;
+
+    return base + (gq * LQ_NUM + lq + 1) * TAIC_PAGE_SIZE;
+}
+
+static uint64_t taic_page(uint64_t idx)
+{
+    return taic_page_at(TAIC_BASE, idx);
+}
+
+static void test_alloc_free(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t a, b, c;
+
+    a = taic_alloc(qts, 1, 1);
+    b = taic_alloc(qts, 1, 1);
+    c = taic_alloc(qts, 1, 2);
+
+    /* the same process gets a new local queue of the same global queue */
+    g_assert_cmpuint(taic_gq(a), ==, taic_gq(b));
+    g_assert_cmpuint(a, !=, b);
+    g_assert_cmpuint(taic_gq(a), !=, taic_gq(c));
+
+    /* a freed global queue is handed out again */
+    taic_free(qts, a);
+    taic_free(qts, b);
+    g_assert_cmpuint(taic_alloc(qts, 1, 3), ==, a);
+
+    /* (0, 0) names a free global queue and cannot be allocated */
+    g_assert_cmpint(taic_alloc(qts, 0, 0), ==, TAIC_ALLOC_INVALID_ID);
+
+    /* (1, 3) and (1, 2) hold two of the four global queues */
+    taic_alloc(qts, 1, 4);
+    taic_alloc(qts, 1, 5);
+    g_assert_cmpint(taic_alloc(qts, 1, 6), ==, TAIC_ALLOC_NO_SLOTS);
+
+    qtest_quit(qts);
+}
+
+static void test_enq_deq(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t page = taic_page(taic_alloc(qts, 1, 1));
+    int i;
+
+    for (i = 1; i <= 16; i++) {
+        qtest_writeq(qts, page + TAIC_ENQ, i << 4);
+    }
+    for (i = 1; i <= 16; i++) {
+        g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, i << 4);
+    }
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_ERROR), ==, 0);
+
+    qtest_quit(qts);
+}
+
+static void test_steal(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t victim = taic_page(taic_alloc(qts, 1, 1));
+    uint64_t thief = taic_page(taic_alloc(qts, 1, 1));
+
+    qtest_writeq(qts, victim + TAIC_ENQ, 0x100);
+    g_assert_cmphex(qtest_readq(qts, thief + TAIC_DEQ), ==, 0x100);
+    g_assert_cmpuint(qtest_readq(qts, thief + TAIC_STEALS), ==, 1);
+
+    /* with stealing disabled the task stays in its local queue */
+    qtest_writeq(qts, thief + TAIC_STEAL_POLICY, TAIC_STEAL_DISABLED);
+    qtest_writeq(qts, victim + TAIC_ENQ, 0x200);
+    g_assert_cmphex(qtest_readq(qts, thief + TAIC_DEQ), ==, 0);
+    g_assert_cmphex(qtest_readq(qts, victim + TAIC_DEQ), ==, 0x200);
+
+    qtest_quit(qts);
+}
+
+/* An empty shared ring in guest RAM, see hw/taic/shmring.c for the layout */
+#define SHM_RING_GPA        0x80100000
+#define SHM_RING_SIZE       8
+
+static void shm_ring_init(QTestState *qts, uint64_t gpa, int size)
+{
+    int i;
+
+    qtest_writeq(qts, gpa, 0);
+    qtest_writeq(qts, gpa + 0x40, 0);
+    for (i = 0; i < size; i++) {
+        qtest_writeq(qts, gpa + 0x80 + 16 * i, i);
+    }
+}
+
+static void test_steal_shm(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t victim = taic_page(taic_alloc(qts, 1, 1));
+    uint64_t thief = taic_page(taic_alloc(qts, 1, 1));
+
+    shm_ring_init(qts, SHM_RING_GPA, SHM_RING_SIZE);
+    qtest_writeq(qts, victim + TAIC_SHM_ADDR, SHM_RING_GPA);
+    qtest_writeq(qts, victim + TAIC_SHM_SIZE, SHM_RING_SIZE);
+    g_assert_cmphex(qtest_readq(qts, victim + TAIC_ERROR), ==, 0);
+
+    /* the task goes into the shared ring and is still stolen */
+    qtest_writeq(qts, victim + TAIC_ENQ, 0x100);
+    g_assert_cmpuint(qtest_readq(qts, SHM_RING_GPA), ==, 1);
+    g_assert_cmphex(qtest_readq(qts, thief + TAIC_DEQ), ==, 0x100);
+    g_assert_cmpuint(qtest_readq(qts, thief + TAIC_STEALS), ==, 1);
+
+    /* stealing half takes two of the four tasks in the ring */
+    qtest_writeq(qts, thief + TAIC_STEAL_POLICY,
+                 TAIC_STEAL_FIRST | TAIC_STEAL_HALF);
+    qtest_writeq(qts, victim + TAIC_ENQ, 0x200);
+    qtest_writeq(qts, victim + TAIC_ENQ, 0x300);
+    qtest_writeq(qts, victim + TAIC_ENQ, 0x400);
+    qtest_writeq(qts, victim + TAIC_ENQ, 0x500);
+    g_assert_cmphex(qtest_readq(qts, thief + TAIC_DEQ), ==, 0x200);
+    g_assert_cmphex(qtest_readq(qts, thief + TAIC_DEQ), ==, 0x300);
+    g_assert_cmphex(qtest_readq(qts, victim + TAIC_DEQ), ==, 0x400);
+    g_assert_cmphex(qtest_readq(qts, victim + TAIC_DEQ), ==, 0x500);
+
+    qtest_quit(qts);
+}
+
+static void test_ext_intr(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t page = taic_page(taic_alloc(qts, 1, 1));
+
+    /* the handler is woken up once, then the slot is empty again */
+    qtest_writeq(qts, page + TAIC_REG_EXT(3), 0x3000);
+    qtest_writeq(qts, TAIC_BASE + TAIC_SIM_EXT(3), 1);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x3000);
+    qtest_writeq(qts, TAIC_BASE + TAIC_SIM_EXT(3), 1);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+
+    qtest_quit(qts);
+}
+
+static void test_persistent(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t sender = taic_page(taic_alloc(qts, 1, 1));
+    uint64_t page = taic_page(taic_alloc(qts, 1, 2));
+    uint64_t ext = 0x3000 | TAIC_HANDLER_PERSISTENT;
+    uint64_t soft = 0x7000 | TAIC_HANDLER_PERSISTENT;
+    int i;
+
+    /* a burst of events queues the handler once for each */
+    qtest_writeq(qts, page + TAIC_REG_EXT(3), ext);
+    for (i = 0; i < 3; i++) {
+        qtest_writeq(qts, TAIC_BASE + TAIC_SIM_EXT(3), 1);
+    }
+    for (i = 0; i < 3; i++) {
+        g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, ext);
+    }
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+
+    qtest_writeq(qts, page + TAIC_REG_RECEIVER, 1);
+    qtest_writeq(qts, page + TAIC_REG_RECEIVER, 1);
+    qtest_writeq(qts, page + TAIC_REG_RECEIVER, soft);
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 1);
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 2);
+    for (i = 0; i < 2; i++) {
+        qtest_writeq(qts, sender + TAIC_SEND_SOFT, 1);
+        qtest_writeq(qts, sender + TAIC_SEND_SOFT, 2);
+    }
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, soft);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, soft);
+
+    /* handler 0 unregisters a persistent handler */
+    qtest_writeq(qts, page + TAIC_REG_EXT(3), 0);
+    qtest_writeq(qts, TAIC_BASE + TAIC_SIM_EXT(3), 1);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+
+    qtest_quit(qts);
+}
+
+static void test_pending(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t sender = taic_page(taic_alloc(qts, 1, 1));
+    uint64_t idx = taic_alloc(qts, 1, 2);
+    uint64_t page = taic_page(idx);
+    uint64_t doorbell = TAIC_MSI_BASE + taic_gq(idx) * TAIC_PAGE_SIZE;
+
+    /* messages to a slot without a handler wait for the next one */
+    qtest_writel(qts, doorbell, 5);
+    qtest_writel(qts, doorbell, 5);
+    qtest_writeq(qts, page + TAIC_REG_EXT(5), 0x5000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x5000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+    qtest_writeq(qts, page + TAIC_REG_EXT(5), 0x5000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x5000);
+
+    /* a wired source keeps counting after its one-shot handler fired */
+    qtest_writeq(qts, page + TAIC_REG_EXT(3), 0x3000);
+    qtest_writeq(qts, TAIC_BASE + TAIC_SIM_EXT(3), 1);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x3000);
+    qtest_writeq(qts, TAIC_BASE + TAIC_SIM_EXT(3), 1);
+    qtest_writeq(qts, TAIC_BASE + TAIC_SIM_EXT(3), 1);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+    qtest_writeq(qts, page + TAIC_REG_EXT(3), 0x3000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x3000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+    qtest_writeq(qts, page + TAIC_REG_EXT(3), 0x3000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x3000);
+
+    /* so do soft interrupts sent before the receiver registers */
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 1);
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 2);
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 1);
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 2);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+    qtest_writeq(qts, page + TAIC_REG_RECEIVER, 1);
+    qtest_writeq(qts, page + TAIC_REG_RECEIVER, 1);
+    qtest_writeq(qts, page + TAIC_REG_RECEIVER, 0x7000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x7000);
+
+    qtest_quit(qts);
+}
+
+static void taic_reg_receiver(QTestState *qts, uint64_t page, uint64_t os_id,
+                              uint64_t proc_id, uint64_t handler)
+{
+    qtest_writeq(qts, page + TAIC_REG_RECEIVER, os_id);
+    qtest_writeq(qts, page + TAIC_REG_RECEIVER, proc_id);
+    qtest_writeq(qts, page + TAIC_REG_RECEIVER, handler);
+}
+
+static void test_unregister(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t sender = taic_page(taic_alloc(qts, 1, 1));
+    uint64_t page = taic_page(taic_alloc(qts, 1, 2));
+    uint64_t soft = 0x7000 | TAIC_HANDLER_PERSISTENT;
+    int i;
+
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 1);
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 2);
+
+    /* soft interrupts after handler 0 are counted, not swallowed */
+    taic_reg_receiver(qts, page, 1, 1, soft);
+    taic_reg_receiver(qts, page, 1, 1, 0);
+    for (i = 0; i < 2; i++) {
+        qtest_writeq(qts, sender + TAIC_SEND_SOFT, 1);
+        qtest_writeq(qts, sender + TAIC_SEND_SOFT, 2);
+    }
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+    taic_reg_receiver(qts, page, 1, 1, soft);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, soft);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, soft);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+
+    /* handler 0 does not consume a pending soft interrupt */
+    taic_reg_receiver(qts, page, 1, 1, 0);
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 1);
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 2);
+    taic_reg_receiver(qts, page, 1, 1, 0);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+    taic_reg_receiver(qts, page, 1, 1, 0x7000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x7000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_ERROR), ==, 0);
+
+    qtest_quit(qts);
+}
+
+static void test_msi(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t idx = taic_alloc(qts, 1, 1);
+    uint64_t page = taic_page(idx);
+    uint64_t doorbell = TAIC_MSI_BASE + taic_gq(idx) * TAIC_PAGE_SIZE;
+
+    qtest_writeq(qts, page + TAIC_REG_EXT(5), 0x5000);
+    qtest_writel(qts, doorbell, 5);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x5000);
+
+    qtest_quit(qts);
+}
+
+static void test_soft_intr(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t sender = taic_page(taic_alloc(qts, 1, 1));
+    uint64_t receiver = taic_page(taic_alloc(qts, 1, 2));
+
+    /* the receiver accepts soft interrupts from (1, 1) */
+    qtest_writeq(qts, receiver + TAIC_REG_RECEIVER, 1);
+    qtest_writeq(qts, receiver + TAIC_REG_RECEIVER, 1);
+    qtest_writeq(qts, receiver + TAIC_REG_RECEIVER, 0x7000);
+
+    /* without a send capability nothing is delivered */
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 1);
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 2);
+    g_assert_cmphex(qtest_readq(qts, receiver + TAIC_DEQ), ==, 0);
+
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 1);
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 2);
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 1);
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 2);
+    g_assert_cmphex(qtest_readq(qts, receiver + TAIC_DEQ), ==, 0x7000);
+
+    qtest_quit(qts);
+}
+
+static void test_sleep(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t page = taic_page(taic_alloc(qts, 1, 1));
+
+    /* the virtual clock only moves with clock_step */
+    qtest_writeq(qts, page + TAIC_SLEEP_DEADLINE, 2 * TAIC_TICKS_PER_MS);
+    qtest_writeq(qts, page + TAIC_SLEEP, 0x9000);
+    qtest_writeq(qts, page + TAIC_SLEEP_DEADLINE, 1 * TAIC_TICKS_PER_MS);
+    qtest_writeq(qts, page + TAIC_SLEEP, 0xa000);
+    qtest_writeq(qts, page + TAIC_SLEEP_DEADLINE, 3 * TAIC_TICKS_PER_MS);
+    qtest_writeq(qts, page + TAIC_SLEEP, 0xb000);
+    qtest_writeq(qts, page + TAIC_CANCEL_SLEEP, 0xb000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+
+    /* tasks wake up in deadline order, the cancelled one never does */
+    qtest_clock_step(qts, 1 * SCALE_MS);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0xa000);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+    qtest_clock_step(qts, 1 * SCALE_MS);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0x9000);
+    qtest_clock_step(qts, 2 * SCALE_MS);
+    g_assert_cmphex(qtest_readq(qts, page + TAIC_DEQ), ==, 0);
+
+    qtest_quit(qts);
+}
+
+static void test_soft_intr_remote(void)
+{
+    QTestState *qts = taic_start_numa();
+    uint64_t sender = taic_page(taic_alloc(qts, 1, 1));
+    uint64_t receiver = taic_page_at(TAIC_REMOTE_BASE,
+                                     taic_alloc_at(qts, TAIC_REMOTE_BASE, 1, 2));
+
+    /* the receiver lives on socket 1, the sender on socket 0 */
+    qtest_writeq(qts, receiver + TAIC_REG_RECEIVER, 1);
+    qtest_writeq(qts, receiver + TAIC_REG_RECEIVER, 1);
+    qtest_writeq(qts, receiver + TAIC_REG_RECEIVER, 0x7000);
+
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 1);
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 2);
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 1);
+    qtest_writeq(qts, sender + TAIC_SEND_SOFT, 2);
+    g_assert_cmphex(qtest_readq(qts, receiver + TAIC_DEQ), ==, 0x7000);
+
+    qtest_quit(qts);
+}
+
+static void bench_report(const char *name, double secs)
+{
+    g_test_maximized_result(BENCH_OPS / secs, "%s: %.0f ops/s",
+                            name, BENCH_OPS / secs);
+}
+
+static void bench_enq_deq(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t page = taic_page(taic_alloc(qts, 1, 1));
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_OPS; i++) {
+        qtest_writeq(qts, page + TAIC_ENQ, 0x10);
+        qtest_readq(qts, page + TAIC_DEQ);
+    }
+    bench_report("enq+deq", g_test_timer_elapsed());
+
+    qtest_quit(qts);
+}
+
+static void bench_steal(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t victim = taic_page(taic_alloc(qts, 1, 1));
+    uint64_t thief = taic_page(taic_alloc(qts, 1, 1));
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_OPS; i++) {
+        qtest_writeq(qts, victim + TAIC_ENQ, 0x10);
+        qtest_readq(qts, thief + TAIC_DEQ);
+    }
+    bench_report("enq+steal", g_test_timer_elapsed());
+
+    qtest_quit(qts);
+}
+
+static void bench_ext_intr(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t page = taic_page(taic_alloc(qts, 1, 1));
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_OPS; i++) {
+        qtest_writeq(qts, page + TAIC_REG_EXT(3), 0x3000);
+        qtest_writeq(qts, TAIC_BASE + TAIC_SIM_EXT(3), 1);
+        qtest_readq(qts, page + TAIC_DEQ);
+    }
+    bench_report("ext wakeup", g_test_timer_elapsed());
+
+    qtest_quit(qts);
+}
+
+static void bench_soft_intr(void)
+{
+    QTestState *qts = taic_start();
+    uint64_t sender = taic_page(taic_alloc(qts, 1, 1));
+    uint64_t receiver = taic_page(taic_alloc(qts, 1, 2));
+    int i;
+
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 1);
+    qtest_writeq(qts, sender + TAIC_REG_SENDER, 2);
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_OPS; i++) {
+        qtest_writeq(qts, receiver + TAIC_REG_RECEIVER, 1);
+        qtest_writeq(qts, receiver + TAIC_REG_RECEIVER, 1);
+        qtest_writeq(qts, receiver + TAIC_REG_RECEIVER, 0x7000);
+        qtest_writeq(qts, sender + TAIC_SEND_SOFT, 1);
+        qtest_writeq(qts, sender + TAIC_SEND_SOFT, 2);
+        qtest_readq(qts, receiver + TAIC_DEQ);
+    }
+    bench_report("soft ipc", g_test_timer_elapsed());
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/taic/alloc-free", test_alloc_free);
+    qtest_add_func("/taic/enq-deq", test_enq_deq);
+    qtest_add_func("/taic/steal", test_steal);
+    qtest_add_func("/taic/steal-shm", test_steal_shm);
+    qtest_add_func("/taic/ext-intr", test_ext_intr);
+    qtest_add_func("/taic/msi", test_msi);
+    qtest_add_func("/taic/persistent", test_persistent);
+    qtest_add_func("/taic/pending", test_pending);
+    qtest_add_func("/taic/unregister", test_unregister);
+    qtest_add_func("/taic/soft-intr", test_soft_intr);
+    qtest_add_func("/taic/soft-intr-remote", test_soft_intr_remote);
+    qtest_add_func("/taic/sleep", test_sleep);
+    if (g_test_perf()) {
+        qtest_add_func("/taic/bench/enq-deq", bench_enq_deq);
+        qtest_add_func("/taic/bench/steal", bench_steal);
+        qtest_add_func("/taic/bench/ext-intr", bench_ext_intr);
+        qtest_add_func("/taic/bench/soft-intr", bench_soft_intr);
+    }
+
+    return g_test_run();
+}